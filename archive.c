@@ -0,0 +1,929 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "cipher.h"
+
+/*
+ * Archives: a whole directory tree in one encrypted file.
+ *
+ * The files are packed one after the other into a single CTR stream, so
+ * a tree of millions of small files costs one output file, one key
+ * schedule and block sized writes instead of a file, a key and a write
+ * each. After the data comes an index of every member and where its data
+ * is in the stream, and after that a trailer saying where the index is.
+ * Everything but the header is encrypted, names included. CTR can start
+ * anywhere, so one member is taken out by decrypting the trailer, the
+ * index and that member's data, without reading the rest.
+ *
+ * The file:
+ *   0  "BFARCHIV"
+ *   8  version
+ *   9  mode, always CTR
+ *  10  zero
+ *  16  initial counter
+ *  24  the stream: the data of the members, the index, the trailer
+ * An index entry:
+ *   0  offset of the data in the stream
+ *   8  size of the data
+ *  16  st_mode
+ *  20  modification time, seconds
+ *  28  length of the name
+ *  30  name, the path relative to the top of the tree
+ * Directories are listed before what is in them and have no data. The
+ * trailer, the last ARCHIVE_TRAILER bytes of the stream:
+ *   0  "BFINDEX1"
+ *   8  offset of the index in the stream
+ *  16  number of entries
+ * All numbers are big endian, 64 bit but for st_mode (32) and the length
+ * of the name (16). A trailer that doesn't start with its magic means the
+ * file isn't an archive or the password is wrong.
+ */
+
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_HEADER 24
+#define ARCHIVE_TRAILER_MAGIC "BFINDEX1"
+#define ARCHIVE_TRAILER 24
+#define ARCHIVE_ENTRY_HEAD 30
+#define ARCHIVE_NAME_MAX 65535
+
+/* A member, name is an offset into the names of its index */
+struct archive_entry
+{
+	off_t offset;
+	off_t size;
+	unsigned int mode;
+	int64_t mtime;
+	size_t name;
+	size_t name_len;
+};
+
+struct archive_index
+{
+	struct archive_entry *entries;
+	size_t count;
+	size_t cap;
+	char *names;
+	size_t names_len;
+	size_t names_cap;
+};
+
+/*
+ * State of packing a tree
+ * buffer collects block_size bytes of plaintext at a time, fill of them
+ * so far, pos is the offset in the stream of the end of what is in it
+ */
+struct packer
+{
+	const struct crypt_ctx *ctx;
+	struct stream st;
+	struct writebehind wb;
+	unsigned char *buffer;
+	size_t fill;
+	off_t pos;
+	struct archive_index index;
+	dev_t self_dev;		/* the archive, should it be inside the tree */
+	ino_t self_ino;
+	char path[PATH_MAX];	/* of what is being packed, relative to the top */
+};
+
+/*
+ * Adds an entry for name to index, the name is copied
+ * Returns 0 on success or -1 with errno set
+ */
+static int index_add(struct archive_index *index, const char *name, size_t name_len,
+	const struct stat *file_stat, off_t offset, off_t size)
+{
+	struct archive_entry *entries;
+	struct archive_entry *e;
+	char *names;
+	size_t cap;
+
+	if (index->count == index->cap)
+	{
+		cap = index->cap != 0 ? 2 * index->cap : 1024;
+		if ((entries = realloc(index->entries, cap * sizeof(*entries))) == NULL)
+		{
+			return -1;
+		}
+		index->entries = entries;
+		index->cap = cap;
+	}
+	if (index->names_len + name_len > index->names_cap)
+	{
+		cap = index->names_cap != 0 ? 2 * index->names_cap : 64 * 1024;
+		while (cap < index->names_len + name_len)
+		{
+			cap *= 2;
+		}
+		if ((names = realloc(index->names, cap)) == NULL)
+		{
+			return -1;
+		}
+		index->names = names;
+		index->names_cap = cap;
+	}
+
+	e = &index->entries[index->count++];
+	e->offset = offset;
+	e->size = size;
+	e->mode = file_stat->st_mode;
+	e->mtime = file_stat->st_mtime;
+	e->name = index->names_len;
+	e->name_len = name_len;
+	memcpy(index->names + index->names_len, name, name_len);
+	index->names_len += name_len;
+	return 0;
+}
+
+static void index_free(struct archive_index *index)
+{
+	free(index->entries);
+	free(index->names);
+	memset(index, 0, sizeof(*index));
+}
+
+/*
+ * Encrypts and writes out what is in the buffer
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+static int pack_flush(struct packer *pk)
+{
+	stream_crypt(&pk->st, pk->buffer, pk->buffer, pk->fill);
+	if (write_full(pk->ctx->outfile_des, pk->buffer, pk->fill) < 0)
+	{
+		perror(pk->ctx->outfile);
+		return -1;
+	}
+	wb_advance(&pk->wb, pk->fill);
+	pk->fill = 0;
+	return 0;
+}
+
+/*
+ * Adds len bytes at data to the stream
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+static int pack_write(struct packer *pk, const unsigned char *data, size_t len)
+{
+	size_t n;
+
+	while (len > 0)
+	{
+		if (pk->fill == pk->ctx->block_size && pack_flush(pk) < 0)
+		{
+			return -1;
+		}
+		n = pk->ctx->block_size - pk->fill < len ? pk->ctx->block_size - pk->fill : len;
+		memcpy(pk->buffer + pk->fill, data, n);
+		pk->fill += n;
+		pk->pos += n;
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Adds the contents of file_des, the file at pk->path, to the stream,
+ * read straight into the buffer, and its entry to the index
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+static int pack_file(struct packer *pk, int file_des, const struct stat *file_stat, size_t len)
+{
+	off_t offset = pk->pos;
+	ssize_t bytes_read;
+
+	for (;;)
+	{
+		if (pk->fill == pk->ctx->block_size && pack_flush(pk) < 0)
+		{
+			return -1;
+		}
+		if ((bytes_read = read(file_des, pk->buffer + pk->fill, pk->ctx->block_size - pk->fill)) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			perror(pk->path);
+			return -1;
+		}
+		if (bytes_read == 0)
+		{
+			break;
+		}
+		pk->fill += bytes_read;
+		pk->pos += bytes_read;
+	}
+
+	/* What was read is what counts, should the file have changed size */
+	if (index_add(&pk->index, pk->path, len, file_stat, offset, pk->pos - offset) < 0)
+	{
+		perror(pk->path);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Packs what is in the directory dir_des, which is at the first len bytes
+ * of pk->path, and below; dir_des is closed
+ * Symbolic links, devices and the like are left out, with a warning
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+static int pack_dir(struct packer *pk, int dir_des, size_t len)
+{
+	struct stat file_stat;
+	struct dirent *de;
+	DIR *dir;
+	size_t name_len;
+	int file_des;
+	int ret = 0;
+
+	if ((dir = fdopendir(dir_des)) == NULL)
+	{
+		perror(len > 0 ? pk->path : pk->ctx->infile);
+		close(dir_des);
+		return -1;
+	}
+
+	while (ret == 0 && (errno = 0, de = readdir(dir)) != NULL)
+	{
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+		{
+			continue;
+		}
+		name_len = strlen(de->d_name);
+		if (len + 1 + name_len >= sizeof(pk->path) || len + 1 + name_len > ARCHIVE_NAME_MAX)
+		{
+			pk->path[len] = '\0';
+			fprintf(stderr, "%s/%s: name too long\n", pk->path, de->d_name);
+			ret = -1;
+			break;
+		}
+		/* The path of the entry, relative to the top */
+		if (len > 0)
+		{
+			pk->path[len] = '/';
+		}
+		memcpy(pk->path + len + (len > 0), de->d_name, name_len + 1);
+		name_len += len + (len > 0);
+
+		if (fstatat(dirfd(dir), de->d_name, &file_stat, AT_SYMLINK_NOFOLLOW) < 0)
+		{
+			perror(pk->path);
+			ret = -1;
+		}
+		else if (file_stat.st_dev == pk->self_dev && file_stat.st_ino == pk->self_ino)
+		{
+			/* The archive itself */
+		}
+		else if (S_ISDIR(file_stat.st_mode))
+		{
+			if (index_add(&pk->index, pk->path, name_len, &file_stat, pk->pos, 0) < 0 ||
+				(file_des = openat(dirfd(dir), de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW)) < 0)
+			{
+				perror(pk->path);
+				ret = -1;
+			}
+			else
+			{
+				ret = pack_dir(pk, file_des, name_len);
+			}
+		}
+		else if (S_ISREG(file_stat.st_mode))
+		{
+			if ((file_des = openat(dirfd(dir), de->d_name, O_RDONLY | O_NOFOLLOW)) < 0)
+			{
+				perror(pk->path);
+				ret = -1;
+			}
+			else
+			{
+				ret = pack_file(pk, file_des, &file_stat, name_len);
+				close(file_des);
+			}
+		}
+		else
+		{
+			fprintf(stderr, "%s: not a regular file or directory, left out\n", pk->path);
+		}
+	}
+	if (ret == 0 && errno != 0)
+	{
+		pk->path[len] = '\0';
+		perror(len > 0 ? pk->path : pk->ctx->infile);
+		ret = -1;
+	}
+
+	closedir(dir);
+	return ret;
+}
+
+/*
+ * Adds the index and the trailer to the stream
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+static int pack_index(struct packer *pk)
+{
+	const struct archive_index *index = &pk->index;
+	const struct archive_entry *e;
+	unsigned char head[ARCHIVE_ENTRY_HEAD];
+	unsigned char trailer[ARCHIVE_TRAILER];
+	off_t index_offset = pk->pos;
+	size_t i;
+
+	for (i = 0; i < index->count; i++)
+	{
+		e = &index->entries[i];
+		put64(head, e->offset);
+		put64(head + 8, e->size);
+		put32(head + 16, e->mode);
+		put64(head + 20, (uint64_t) e->mtime);
+		head[28] = (unsigned char) (e->name_len >> 8);
+		head[29] = (unsigned char) e->name_len;
+		if (pack_write(pk, head, sizeof(head)) < 0 ||
+			pack_write(pk, (const unsigned char *) index->names + e->name, e->name_len) < 0)
+		{
+			return -1;
+		}
+	}
+
+	memcpy(trailer, ARCHIVE_TRAILER_MAGIC, 8);
+	put64(trailer + 8, index_offset);
+	put64(trailer + 16, index->count);
+	return pack_write(pk, trailer, sizeof(trailer));
+}
+
+/*
+ * Packs the directory tree ctx->infile into an archive on ctx->outfile,
+ * from its current offset, which only gets written to from front to back
+ * ctx has the key, the block size and a random initial counter in iv
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+int archive_pack(const struct crypt_ctx *ctx)
+{
+	struct packer *pk;
+	struct arena arena;
+	struct stat outfile_stat;
+	unsigned char header[ARCHIVE_HEADER];
+	int dir_des;
+	int ret;
+
+	/* Too big for the stack, with the path */
+	if ((pk = calloc(1, sizeof(*pk))) == NULL)
+	{
+		fprintf(stderr, "%s\n", strerror(errno));
+		return -1;
+	}
+	if ((pk->buffer = arena_alloc(&arena, ctx->block_size)) == NULL)
+	{
+		fprintf(stderr, "%s\n", strerror(errno));
+		free(pk);
+		return -1;
+	}
+	pk->ctx = ctx;
+	if (fstat(ctx->outfile_des, &outfile_stat) == 0)
+	{
+		pk->self_dev = outfile_stat.st_dev;
+		pk->self_ino = outfile_stat.st_ino;
+	}
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, ARCHIVE_MAGIC, HEADER_MAGIC_LEN);
+	header[8] = ARCHIVE_VERSION;
+	header[9] = MODE_CTR64;
+	memcpy(header + 16, ctx->iv, 8);
+	ret = write_full(ctx->outfile_des, header, sizeof(header));
+	if (ret < 0)
+	{
+		perror(ctx->outfile);
+	}
+	wb_init(&pk->wb, ctx->outfile_des);
+	stream_init(&pk->st, ctx);
+
+	if (ret == 0 && (dir_des = open(ctx->infile, O_RDONLY | O_DIRECTORY)) < 0)
+	{
+		perror(ctx->infile);
+		ret = -1;
+	}
+	if (ret == 0)
+	{
+		ret = pack_dir(pk, dir_des, 0);
+	}
+	if (ret == 0)
+	{
+		ret = pack_index(pk);
+	}
+	if (ret == 0 && pk->fill > 0)
+	{
+		ret = pack_flush(pk);
+	}
+
+	index_free(&pk->index);
+	memset(&pk->st, 0, sizeof(pk->st));
+	arena_free(&arena);
+	free(pk);
+	return ret;
+}
+
+/*
+ * Decrypts len bytes at offset in the stream of the archive ctx->infile
+ * into buf
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+static int unpack_read(const struct crypt_ctx *ctx, unsigned char *buf, size_t len, off_t offset)
+{
+	struct stream st;
+	ssize_t got;
+
+	/* Seeking in CTR can't fail */
+	stream_init(&st, ctx);
+	stream_seek(&st, ctx, offset);
+	if ((got = pread_full(ctx->infile_des, buf, len, ctx->in_base + offset)) < 0 ||
+		(size_t) got != len)
+	{
+		if (got >= 0)
+		{
+			errno = EIO;
+		}
+		perror(ctx->infile);
+		return -1;
+	}
+	stream_crypt(&st, buf, buf, len);
+	memset(&st, 0, sizeof(st));
+	return 0;
+}
+
+/*
+ * Sets ctx up from the header of the archive ctx->infile and reads its
+ * index; the names of the index are the decrypted index itself
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+static int index_read(struct crypt_ctx *ctx, struct archive_index *index)
+{
+	unsigned char header[ARCHIVE_HEADER];
+	unsigned char trailer[ARCHIVE_TRAILER];
+	struct archive_entry *e;
+	unsigned char *p;
+	off_t size;
+	off_t index_offset;
+	size_t index_len;
+	uint64_t count;
+	size_t pos;
+	size_t i;
+
+	memset(index, 0, sizeof(*index));
+	if (file_size(ctx->infile_des, &size) < 0 ||
+		pread_full(ctx->infile_des, header, sizeof(header), 0) < 0)
+	{
+		perror(ctx->infile);
+		return -1;
+	}
+	if (size < ARCHIVE_HEADER + ARCHIVE_TRAILER || memcmp(header, ARCHIVE_MAGIC, HEADER_MAGIC_LEN) != 0 ||
+		header[8] != ARCHIVE_VERSION || header[9] != MODE_CTR64)
+	{
+		fprintf(stderr, "%s: not an archive, or of a newer version\n", ctx->infile);
+		return -1;
+	}
+	ctx->mode = MODE_CTR64;
+	ctx->chunk_shift = 0;
+	memcpy(ctx->iv, header + 16, 8);
+	ctx->in_base = ARCHIVE_HEADER;
+	size -= ARCHIVE_HEADER + ARCHIVE_TRAILER;
+
+	if (unpack_read(ctx, trailer, sizeof(trailer), size) < 0)
+	{
+		return -1;
+	}
+	index_offset = get64(trailer + 8);
+	count = get64(trailer + 16);
+	if (memcmp(trailer, ARCHIVE_TRAILER_MAGIC, 8) != 0 || index_offset < 0 || index_offset > size ||
+		count > (uint64_t) (size - index_offset) / ARCHIVE_ENTRY_HEAD)
+	{
+		fprintf(stderr, "%s: wrong password, or not an archive\n", ctx->infile);
+		return -1;
+	}
+
+	index_len = size - index_offset;
+	if ((index->names = malloc(index_len + 1)) == NULL ||
+		(index->entries = calloc(count + 1, sizeof(*index->entries))) == NULL)
+	{
+		fprintf(stderr, "%s\n", strerror(errno));
+		index_free(index);
+		return -1;
+	}
+	if (unpack_read(ctx, (unsigned char *) index->names, index_len, index_offset) < 0)
+	{
+		index_free(index);
+		return -1;
+	}
+
+	for (i = 0, pos = 0; i < count; i++)
+	{
+		p = (unsigned char *) index->names + pos;
+		e = &index->entries[i];
+		if (index_len - pos < ARCHIVE_ENTRY_HEAD)
+		{
+			break;
+		}
+		e->offset = get64(p);
+		e->size = get64(p + 8);
+		e->mode = get32(p + 16);
+		e->mtime = (int64_t) get64(p + 20);
+		e->name_len = ((size_t) p[28] << 8) | p[29];
+		e->name = pos + ARCHIVE_ENTRY_HEAD;
+		pos += ARCHIVE_ENTRY_HEAD + e->name_len;
+		if (pos > index_len || e->offset < 0 || e->size < 0 || e->offset > index_offset ||
+			e->size > index_offset - e->offset)
+		{
+			break;
+		}
+	}
+	if (i != count)
+	{
+		fprintf(stderr, "%s: damaged index\n", ctx->infile);
+		index_free(index);
+		return -1;
+	}
+	index->count = count;
+	return 0;
+}
+
+/*
+ * Decrypts the data of e onto out_des, named out
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+static int unpack_member(const struct crypt_ctx *ctx, const struct archive_entry *e,
+	int out_des, const char *out, unsigned char *buffer)
+{
+	struct stream st;
+	off_t done;
+	size_t n;
+	ssize_t got;
+	int ret = 0;
+
+	stream_init(&st, ctx);
+	stream_seek(&st, ctx, e->offset);
+	for (done = 0; done < e->size; done += n)
+	{
+		n = e->size - done < (off_t) ctx->block_size ? e->size - done : ctx->block_size;
+		if ((got = pread_full(ctx->infile_des, buffer, n, ctx->in_base + e->offset + done)) < 0 ||
+			(size_t) got != n)
+		{
+			if (got >= 0)
+			{
+				errno = EIO;
+			}
+			perror(ctx->infile);
+			ret = -1;
+			break;
+		}
+		stream_crypt(&st, buffer, buffer, n);
+		if (write_full(out_des, buffer, n) < 0)
+		{
+			perror(out);
+			ret = -1;
+			break;
+		}
+	}
+	memset(&st, 0, sizeof(st));
+	return ret;
+}
+
+/*
+ * Tells whether name can be extracted under a directory: relative, and
+ * with no empty, . or .. parts that could take it anywhere else
+ */
+static int name_safe(const char *name)
+{
+	const char *part = name;
+	const char *end;
+	size_t len;
+
+	if (*name == '\0' || *name == '/')
+	{
+		return 0;
+	}
+	for (;;)
+	{
+		end = strchr(part, '/');
+		len = end != NULL ? (size_t) (end - part) : strlen(part);
+		if (len == 0 || (len == 1 && part[0] == '.') || (len == 2 && part[0] == '.' && part[1] == '.'))
+		{
+			return 0;
+		}
+		if (end == NULL)
+		{
+			return 1;
+		}
+		part = end + 1;
+	}
+}
+
+/*
+ * Opens the directory that is the first len bytes of name under the
+ * directory top_des a part at a time, none of them followed if it is a
+ * symlink, so nothing already under top_des can send what is extracted
+ * anywhere else
+ * Returns the descriptor or -1 with errno set
+ */
+static int open_under(int top_des, const char *name, size_t len)
+{
+	char part[NAME_MAX + 1];
+	const char *end;
+	size_t n;
+	int dir_des;
+	int next;
+	int err;
+
+	if ((dir_des = dup(top_des)) < 0)
+	{
+		return -1;
+	}
+	while (len > 0)
+	{
+		end = memchr(name, '/', len);
+		n = end != NULL ? (size_t) (end - name) : len;
+		if (n > NAME_MAX)
+		{
+			close(dir_des);
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		memcpy(part, name, n);
+		part[n] = '\0';
+		next = openat(dir_des, part, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		err = errno;
+		close(dir_des);
+		if (next < 0)
+		{
+			errno = err;
+			return -1;
+		}
+		dir_des = next;
+		name += n;
+		len -= n;
+		if (len > 0)
+		{
+			name++;
+			len--;
+		}
+	}
+	return dir_des;
+}
+
+/*
+ * Extracts member e to base in the directory parent_des, path being what
+ * that is called in messages
+ * Directories are created as they come, writable by the user whatever
+ * their mode, which is set by archive_unpack once everything is in them.
+ * One that is already there has to be a directory, not a symlink to one;
+ * a file that is already there is replaced, not written through, in case
+ * it is a hard link.
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+static int unpack_entry(const struct crypt_ctx *ctx, const struct archive_entry *e, int parent_des,
+	const char *base, const char *path, unsigned char *buffer)
+{
+	struct timespec times[2];
+	struct stat file_stat;
+	int file_des;
+	int ret;
+
+	if (S_ISDIR(e->mode))
+	{
+		if (mkdirat(parent_des, base, S_IRWXU) < 0)
+		{
+			if (errno != EEXIST || fstatat(parent_des, base, &file_stat, AT_SYMLINK_NOFOLLOW) < 0)
+			{
+				perror(path);
+				return -1;
+			}
+			if (!S_ISDIR(file_stat.st_mode))
+			{
+				fprintf(stderr, "%s: already there and not a directory\n", path);
+				return -1;
+			}
+		}
+		return 0;
+	}
+	if (!S_ISREG(e->mode))
+	{
+		fprintf(stderr, "%s: not a regular file or directory, left out\n", path);
+		return 0;
+	}
+
+	if ((unlinkat(parent_des, base, 0) < 0 && errno != ENOENT) ||
+		(file_des = openat(parent_des, base, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW,
+		e->mode & 07777)) < 0)
+	{
+		perror(path);
+		return -1;
+	}
+	ret = unpack_member(ctx, e, file_des, path, buffer);
+	times[0].tv_sec = e->mtime;
+	times[0].tv_nsec = 0;
+	times[1] = times[0];
+	if (ret == 0 && futimens(file_des, times) < 0)
+	{
+		perror(path);
+		ret = -1;
+	}
+	if (close(file_des) < 0 && ret == 0)
+	{
+		perror(path);
+		ret = -1;
+	}
+	return ret;
+}
+
+/*
+ * Extracts everything in the archive ctx->infile under the directory dir,
+ * which is created if it isn't there
+ * Everything is created relative to descriptors of the directories it
+ * goes into, opened by open_under; members come directory by directory,
+ * so the one last opened is mostly the one needed next
+ * ctx has the key and the block size
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+int archive_unpack(struct crypt_ctx *ctx, const char *dir)
+{
+	struct archive_index index;
+	const struct archive_entry *e;
+	struct timespec times[2];
+	struct arena arena;
+	unsigned char *buffer;
+	char path[PATH_MAX];
+	const char *name;
+	const char *base;
+	const char *parent = NULL;
+	size_t parent_len = 0;
+	size_t dir_len = strlen(dir);
+	size_t len;
+	size_t i;
+	int top_des = -1;
+	int parent_des = -1;
+	int dir_des;
+	int ret = 0;
+
+	if (index_read(ctx, &index) < 0)
+	{
+		return -1;
+	}
+	if ((buffer = arena_alloc(&arena, ctx->block_size)) == NULL)
+	{
+		fprintf(stderr, "%s\n", strerror(errno));
+		index_free(&index);
+		return -1;
+	}
+	if ((mkdir(dir, S_IRWXU) < 0 && errno != EEXIST) ||
+		(top_des = open(dir, O_RDONLY | O_DIRECTORY)) < 0)
+	{
+		perror(dir);
+		ret = -1;
+	}
+
+	for (i = 0; ret == 0 && i < index.count; i++)
+	{
+		e = &index.entries[i];
+		name = index.names + e->name;
+		/* The index is parsed, the start of the next entry can go */
+		index.names[e->name + e->name_len] = '\0';
+		if (!name_safe(name) || dir_len + 1 + e->name_len >= sizeof(path))
+		{
+			fprintf(stderr, "%s: unsafe or too long name in archive, %s\n", ctx->infile, name);
+			ret = -1;
+			break;
+		}
+		sprintf(path, "%s/%s", dir, name);
+		base = strrchr(name, '/');
+		len = base != NULL ? (size_t) (base - name) : 0;
+		base = base != NULL ? base + 1 : name;
+		if (parent_des < 0 || len != parent_len || memcmp(name, parent, len) != 0)
+		{
+			if (parent_des >= 0)
+			{
+				close(parent_des);
+			}
+			if ((parent_des = open_under(top_des, name, len)) < 0)
+			{
+				perror(path);
+				ret = -1;
+				break;
+			}
+			parent = name;
+			parent_len = len;
+		}
+		ret = unpack_entry(ctx, e, parent_des, base, path, buffer);
+	}
+	if (parent_des >= 0)
+	{
+		close(parent_des);
+	}
+
+	/* Directories last, deepest first, so what went into them doesn't
+	 * change their time and a read-only one could still be filled in */
+	for (i = index.count; ret == 0 && i > 0; i--)
+	{
+		e = &index.entries[i - 1];
+		if (!S_ISDIR(e->mode))
+		{
+			continue;
+		}
+		sprintf(path, "%s/%s", dir, index.names + e->name);
+		times[0].tv_sec = e->mtime;
+		times[0].tv_nsec = 0;
+		times[1] = times[0];
+		if ((dir_des = open_under(top_des, index.names + e->name, e->name_len)) < 0)
+		{
+			perror(path);
+			ret = -1;
+			break;
+		}
+		if (futimens(dir_des, times) < 0 || fchmod(dir_des, e->mode & 07777) < 0)
+		{
+			perror(path);
+			ret = -1;
+		}
+		close(dir_des);
+	}
+
+	if (top_des >= 0)
+	{
+		close(top_des);
+	}
+	arena_free(&arena);
+	index_free(&index);
+	return ret;
+}
+
+/*
+ * Extracts the one member name of the archive ctx->infile onto
+ * ctx->outfile, reading only the index and its data
+ * ctx has the key and the block size
+ * *emptied says whether what was in ctx->outfile is gone, it is left as
+ * it is until the password has been checked
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+int archive_member(struct crypt_ctx *ctx, const char *name, int *emptied)
+{
+	struct archive_index index;
+	const struct archive_entry *e = NULL;
+	struct stat file_stat;
+	struct arena arena;
+	unsigned char *buffer;
+	size_t name_len = strlen(name);
+	size_t i;
+	int ret;
+
+	if (index_read(ctx, &index) < 0)
+	{
+		return -1;
+	}
+	for (i = 0; i < index.count && e == NULL; i++)
+	{
+		if (index.entries[i].name_len == name_len &&
+			memcmp(index.names + index.entries[i].name, name, name_len) == 0)
+		{
+			e = &index.entries[i];
+		}
+	}
+	if (e == NULL || !S_ISREG(e->mode))
+	{
+		fprintf(stderr, "%s: no file %s in archive\n", ctx->infile, name);
+		index_free(&index);
+		return -1;
+	}
+
+	if ((buffer = arena_alloc(&arena, ctx->block_size)) == NULL)
+	{
+		fprintf(stderr, "%s\n", strerror(errno));
+		index_free(&index);
+		return -1;
+	}
+	/* Only now that the index has been read with the key and the member
+	 * is in it is an existing outfile emptied */
+	if (fstat(ctx->outfile_des, &file_stat) == 0 && S_ISREG(file_stat.st_mode) &&
+		ftruncate(ctx->outfile_des, 0) < 0)
+	{
+		perror(ctx->outfile);
+		ret = -1;
+	}
+	else
+	{
+		*emptied = 1;
+		ret = unpack_member(ctx, e, ctx->outfile_des, ctx->outfile, buffer);
+	}
+
+	arena_free(&arena);
+	index_free(&index);
+	return ret;
+}
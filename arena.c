@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include "cipher.h"
+
+/* Size of a huge page on the machines we care about */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/*
+ * Reads the optimal I/O size the kernel reports for the block device dev,
+ * or the disk a partition dev is on
+ * Returns 0 if there is none
+ */
+static size_t device_io_size(dev_t dev)
+{
+	char path[128];
+	unsigned long size = 0;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/optimal_io_size",
+		major(dev), minor(dev));
+	if ((fp = fopen(path, "r")) == NULL)
+	{
+		snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/optimal_io_size",
+			major(dev), minor(dev));
+		fp = fopen(path, "r");
+	}
+	if (fp != NULL)
+	{
+		if (fscanf(fp, "%lu", &size) != 1)
+		{
+			size = 0;
+		}
+		fclose(fp);
+	}
+	return size;
+}
+
+/*
+ * Picks the size of the reads and writes for a pair of files: at least
+ * IO_BLOCK_DEFAULT, more if either file's st_blksize or its device's
+ * optimal I/O size asks for it, rounded to whole pages
+ */
+size_t io_block_size(int infile_des, int outfile_des)
+{
+	int fds[2] = { infile_des, outfile_des };
+	struct stat file_stat;
+	size_t size = IO_BLOCK_DEFAULT;
+	size_t want;
+	int i;
+
+	for (i = 0; i < 2; i++)
+	{
+		if (fstat(fds[i], &file_stat) < 0)
+		{
+			continue;
+		}
+		if ((size_t) file_stat.st_blksize > size)
+		{
+			size = file_stat.st_blksize;
+		}
+		want = device_io_size(S_ISBLK(file_stat.st_mode) ? file_stat.st_rdev : file_stat.st_dev);
+		if (want > size)
+		{
+			size = want;
+		}
+	}
+	size = (size + IO_BLOCK_MIN - 1) & ~(size_t) (IO_BLOCK_MIN - 1);
+	return size > IO_BLOCK_MAX ? IO_BLOCK_MAX : size;
+}
+
+/*
+ * Allocates len bytes of buffers, page aligned, and where it is big
+ * enough backed by huge pages: reserved ones if the system has any,
+ * otherwise transparent ones, for which the mapping is aligned to a huge
+ * page. Either way the TLB covers the buffers with a handful of entries.
+ * Returns NULL on failure, free with arena_free
+ */
+unsigned char *arena_alloc(struct arena *arena, size_t len)
+{
+	size_t huge_len = (len + HUGE_PAGE_SIZE - 1) & ~(size_t) (HUGE_PAGE_SIZE - 1);
+	unsigned char *p;
+	uintptr_t aligned;
+
+	memset(arena, 0, sizeof(*arena));
+	if (len >= HUGE_PAGE_SIZE)
+	{
+#ifdef MAP_HUGETLB
+		p = mmap(NULL, huge_len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED)
+		{
+			arena->base = p;
+			arena->len = huge_len;
+			return p;
+		}
+#endif
+		/* Over-allocate by a huge page and trim both ends to align it */
+		p = mmap(NULL, huge_len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+		{
+			return NULL;
+		}
+		aligned = ((uintptr_t) p + HUGE_PAGE_SIZE - 1) & ~(uintptr_t) (HUGE_PAGE_SIZE - 1);
+		if (aligned > (uintptr_t) p)
+		{
+			munmap(p, aligned - (uintptr_t) p);
+		}
+		munmap((unsigned char *) aligned + huge_len,
+			(uintptr_t) p + HUGE_PAGE_SIZE - aligned);
+		arena->base = (unsigned char *) aligned;
+		arena->len = huge_len;
+#ifdef MADV_HUGEPAGE
+		madvise(arena->base, arena->len, MADV_HUGEPAGE);
+#endif
+		return arena->base;
+	}
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+	{
+		return NULL;
+	}
+	arena->base = p;
+	arena->len = len;
+	return p;
+}
+
+/*
+ * Wipes and unmaps an arena from arena_alloc
+ */
+void arena_free(struct arena *arena)
+{
+	if (arena->base != NULL)
+	{
+		memset(arena->base, 0, arena->len);
+		munmap(arena->base, arena->len);
+		arena->base = NULL;
+	}
+}
@@ -0,0 +1,495 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "cipher.h"
+
+/*
+ * Batch mode: many files with one key and one pool of worker threads.
+ *
+ * For small files the work is not the cipher but everything around it,
+ * a process, a key schedule and a set of buffers per file. Here the key
+ * is set up once, each worker allocates its buffer once, and the files
+ * are handed out as tasks, the names read from a list as they are
+ * needed.
+ *
+ * The list is dealt out round robin onto a deque per worker. A worker
+ * takes the newest task off its own deque, and when that is empty steals
+ * the oldest from another's, so a worker stuck on a big file doesn't hold
+ * up the small ones queued behind it.
+ */
+
+/* Tasks a deque holds; the list is read no further ahead than that */
+#define BATCH_QUEUE_SIZE 256
+
+/* One file to do, the names are stored after it */
+struct batch_task
+{
+	const char *outfile;
+	char infile[];
+};
+
+/*
+ * A worker's deque, tasks top to bottom - 1 (mod BATCH_QUEUE_SIZE)
+ * The owner and the list reader work at the bottom, thieves at the top
+ */
+struct batch_queue
+{
+	struct batch_task *tasks[BATCH_QUEUE_SIZE];
+	size_t top;
+	size_t bottom;
+	pthread_mutex_t lock;
+};
+
+/*
+ * State shared by the workers and the list reader
+ * queued, done and failed are protected by lock; queued only changes
+ * with the lock of the deque it changes in held as well, that one first
+ */
+struct batch_state
+{
+	const struct crypt_ctx *proto;	/* key, direction and block size */
+	const struct encdec_opts *opts;
+	struct batch_queue *queues;
+	int jobs;
+	size_t queued;		/* tasks in all of the deques */
+	int done;		/* the whole list has been read */
+	unsigned long failed;
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* signalled when a task is queued or the list is done */
+	pthread_cond_t space;	/* signalled when the deques stop being full */
+};
+
+/* A worker thread and its buffer */
+struct batch_worker
+{
+	struct batch_state *bs;
+	int self;
+	struct arena arena;
+	unsigned char *buffer;	/* block size + 8 bytes, for CBC padding */
+	pthread_t thread;
+};
+
+/*
+ * Opens the files of ctx, both regular files, outfile created if it isn't
+ * there, in which case *created is set; an existing one is left as it is
+ * for batch_crypt to empty
+ * Returns 0 on success, otherwise prints the error and returns -1 with
+ * nothing open
+ */
+static int batch_open(struct crypt_ctx *ctx, int *created)
+{
+	struct stat infile_stat;
+	struct stat outfile_stat;
+
+	if ((ctx->infile_des = open(ctx->infile, O_RDONLY)) < 0)
+	{
+		perror(ctx->infile);
+		return -1;
+	}
+	if (fstat(ctx->infile_des, &infile_stat) < 0)
+	{
+		perror(ctx->infile);
+		close_file(ctx->infile, ctx->infile_des);
+		return -1;
+	}
+	if (!S_ISREG(infile_stat.st_mode))
+	{
+		fprintf(stderr, "%s is not a regular file\n", ctx->infile);
+		close_file(ctx->infile, ctx->infile_des);
+		return -1;
+	}
+
+	/* Created if it can be, like open_files, so only a file this run
+	 * made is removed when it fails */
+	*created = 0;
+	if ((ctx->outfile_des = open(ctx->outfile, O_WRONLY | O_CREAT | O_EXCL, S_IRWXU)) >= 0)
+	{
+		*created = 1;
+	}
+	else if (errno != EEXIST || (ctx->outfile_des = open(ctx->outfile, O_WRONLY | O_CREAT, S_IRWXU)) < 0)
+	{
+		perror(ctx->outfile);
+		close_file(ctx->infile, ctx->infile_des);
+		return -1;
+	}
+	if (fstat(ctx->outfile_des, &outfile_stat) < 0 || !S_ISREG(outfile_stat.st_mode) ||
+		(outfile_stat.st_dev == infile_stat.st_dev && outfile_stat.st_ino == infile_stat.st_ino))
+	{
+		fprintf(stderr, "%s: not a regular file, or the same file as %s\n", ctx->outfile, ctx->infile);
+		close_file(ctx->infile, ctx->infile_des);
+		close_file(ctx->outfile, ctx->outfile_des);
+		if (*created)
+		{
+			unlink(ctx->outfile);
+		}
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Runs the open files of ctx through the cipher, serially with buffer
+ * As in encdec_file, decryption checks the header and the password before
+ * outfile is emptied, *emptied says whether it has been
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+static int batch_crypt(struct crypt_ctx *ctx, const struct encdec_opts *opts, unsigned char *buffer,
+	int *emptied)
+{
+	struct stream st;
+	ssize_t buffered;
+	ssize_t bytes_read;
+	size_t len;
+	int full;
+	int ret = 0;
+
+	/* What turns out not to be a header is already where the data goes */
+	*emptied = 0;
+	if (!ctx->enc && header_setup(ctx, opts, buffer, &buffered) < 0)
+	{
+		return -1;
+	}
+	/* The tags between the chunks and compressed chunks are left to mac.c
+	 * and compress.c */
+	if (ctx->mac || ctx->compress)
+	{
+		fprintf(stderr, "%s has MACs or is compressed, decrypt it without --batch\n", ctx->infile);
+		return -1;
+	}
+	if (ftruncate(ctx->outfile_des, 0) < 0)
+	{
+		perror(ctx->outfile);
+		return -1;
+	}
+	*emptied = 1;
+	if (ctx->enc && header_setup(ctx, opts, buffer, &buffered) < 0)
+	{
+		return -1;
+	}
+	if (ctx->mode == MODE_CBC)
+	{
+		return cbc_crypt(ctx, buffer);
+	}
+
+	stream_init(&st, ctx);
+	len = buffered;
+	do
+	{
+		if ((bytes_read = read_full(ctx->infile_des, buffer + len, ctx->block_size - len)) < 0)
+		{
+			perror(ctx->infile);
+			ret = -1;
+			break;
+		}
+		full = (size_t) bytes_read == ctx->block_size - len;
+		len += bytes_read;
+		stream_crypt(&st, buffer, buffer, len);
+		if (write_full(ctx->outfile_des, buffer, len) < 0)
+		{
+			perror(ctx->outfile);
+			ret = -1;
+			break;
+		}
+		len = 0;
+	} while (full);
+
+	memset(&st, 0, sizeof(st));
+	return ret;
+}
+
+/*
+ * Does one task, removing a partial outfile if it fails
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+static int batch_file(const struct batch_state *bs, const struct batch_task *task,
+	unsigned char *buffer)
+{
+	struct crypt_ctx ctx = *bs->proto;
+	int created;
+	int emptied;
+	int ret;
+
+	ctx.infile = task->infile;
+	ctx.outfile = task->outfile;
+	if (batch_open(&ctx, &created) < 0)
+	{
+		return -1;
+	}
+
+	ret = batch_crypt(&ctx, bs->opts, buffer, &emptied);
+
+	close_file(ctx.infile, ctx.infile_des);
+	if (close(ctx.outfile_des) < 0)
+	{
+		/* Delayed write errors show up here */
+		perror(ctx.outfile);
+		ret = -1;
+	}
+	/* An existing outfile is only removed once its contents are gone */
+	if (ret < 0 && (created || emptied))
+	{
+		unlink(ctx.outfile);
+	}
+	return ret;
+}
+
+/*
+ * Takes a task for worker self: the newest on its own deque, otherwise the
+ * oldest on the first other deque that has one
+ * Returns NULL if all of them are empty
+ */
+static struct batch_task *batch_take(struct batch_state *bs, int self)
+{
+	struct batch_queue *q;
+	struct batch_task *task = NULL;
+	int i;
+
+	for (i = 0; i < bs->jobs && task == NULL; i++)
+	{
+		q = &bs->queues[(self + i) % bs->jobs];
+		pthread_mutex_lock(&q->lock);
+		if (q->bottom != q->top)
+		{
+			if (i == 0)
+			{
+				task = q->tasks[--q->bottom % BATCH_QUEUE_SIZE];
+			}
+			else
+			{
+				task = q->tasks[q->top++ % BATCH_QUEUE_SIZE];
+			}
+			pthread_mutex_lock(&bs->lock);
+			/* The reader waits for the deques to stop being full */
+			if (bs->queued-- == (size_t) bs->jobs * BATCH_QUEUE_SIZE)
+			{
+				pthread_cond_signal(&bs->space);
+			}
+			pthread_mutex_unlock(&bs->lock);
+		}
+		pthread_mutex_unlock(&q->lock);
+	}
+	return task;
+}
+
+/*
+ * Worker thread: does tasks until the list is done and the deques empty
+ */
+static void *batch_worker(void *arg)
+{
+	struct batch_worker *w = arg;
+	struct batch_state *bs = w->bs;
+	struct batch_task *task;
+
+	for (;;)
+	{
+		if ((task = batch_take(bs, w->self)) != NULL)
+		{
+			if (batch_file(bs, task, w->buffer) < 0)
+			{
+				pthread_mutex_lock(&bs->lock);
+				bs->failed++;
+				pthread_mutex_unlock(&bs->lock);
+			}
+			free(task);
+			continue;
+		}
+
+		pthread_mutex_lock(&bs->lock);
+		while (bs->queued == 0 && !bs->done)
+		{
+			pthread_cond_wait(&bs->work, &bs->lock);
+		}
+		if (bs->queued == 0)
+		{
+			pthread_mutex_unlock(&bs->lock);
+			break;
+		}
+		pthread_mutex_unlock(&bs->lock);
+	}
+	return NULL;
+}
+
+/*
+ * Queues task on the next deque round robin that has room, waiting for
+ * one to if they are all full
+ */
+static void batch_put(struct batch_state *bs, struct batch_task *task, int *next)
+{
+	struct batch_queue *q;
+
+	pthread_mutex_lock(&bs->lock);
+	while (bs->queued == (size_t) bs->jobs * BATCH_QUEUE_SIZE)
+	{
+		pthread_cond_wait(&bs->space, &bs->lock);
+	}
+	pthread_mutex_unlock(&bs->lock);
+
+	/* Only this thread adds tasks, so one of them still has room */
+	for (;;)
+	{
+		q = &bs->queues[*next];
+		*next = (*next + 1) % bs->jobs;
+		pthread_mutex_lock(&q->lock);
+		if (q->bottom - q->top < BATCH_QUEUE_SIZE)
+		{
+			q->tasks[q->bottom++ % BATCH_QUEUE_SIZE] = task;
+			pthread_mutex_lock(&bs->lock);
+			bs->queued++;
+			pthread_cond_signal(&bs->work);
+			pthread_mutex_unlock(&bs->lock);
+			pthread_mutex_unlock(&q->lock);
+			return;
+		}
+		pthread_mutex_unlock(&q->lock);
+	}
+}
+
+/*
+ * Reads the list of pairs of names off list and queues them
+ * Returns the number of files listed, or -1 if the list is broken off or
+ * can't be read, after printing the error; what was queued is still done
+ */
+static long batch_read(struct batch_state *bs, FILE *list)
+{
+	struct batch_task *task;
+	char *infile = NULL;
+	char *outfile = NULL;
+	size_t infile_cap = 0;
+	size_t outfile_cap = 0;
+	ssize_t infile_len;
+	ssize_t outfile_len;
+	long count = 0;
+	int next = 0;
+
+	while ((infile_len = getdelim(&infile, &infile_cap, '\0', list)) > 0)
+	{
+		if ((outfile_len = getdelim(&outfile, &outfile_cap, '\0', list)) <= 0)
+		{
+			fprintf(stderr, "Error: %s has no outfile in the list\n", infile);
+			count = -1;
+			break;
+		}
+		/* The names without their terminators, which the last one may lack */
+		infile_len = strlen(infile);
+		outfile_len = strlen(outfile);
+		if ((task = malloc(sizeof(*task) + infile_len + outfile_len + 2)) == NULL)
+		{
+			fprintf(stderr, "%s\n", strerror(errno));
+			count = -1;
+			break;
+		}
+		memcpy(task->infile, infile, infile_len + 1);
+		memcpy(task->infile + infile_len + 1, outfile, outfile_len + 1);
+		task->outfile = task->infile + infile_len + 1;
+		batch_put(bs, task, &next);
+		count++;
+	}
+	if (ferror(list))
+	{
+		perror("list");
+		count = -1;
+	}
+
+	free(infile);
+	free(outfile);
+	return count;
+}
+
+/*
+ * Encrypts or decrypts each pair of files in list, NUL separated names of
+ * an infile and its outfile one after the other, as opts says, on jobs
+ * worker threads
+ * proto has the key, direction and block size, files failing on their own
+ * don't stop the rest
+ * Returns 0 if all of them were done, otherwise prints the errors and
+ * returns -1
+ */
+int crypt_batch(const struct crypt_ctx *proto, const struct encdec_opts *opts, int jobs, FILE *list)
+{
+	struct batch_state bs;
+	struct batch_worker *workers;
+	long count;
+	int started;
+	int err;
+	int i;
+
+	memset(&bs, 0, sizeof(bs));
+	bs.proto = proto;
+	bs.opts = opts;
+	bs.jobs = jobs;
+	pthread_mutex_init(&bs.lock, NULL);
+	pthread_cond_init(&bs.work, NULL);
+	pthread_cond_init(&bs.space, NULL);
+
+	workers = calloc(jobs, sizeof(*workers));
+	bs.queues = calloc(jobs, sizeof(*bs.queues));
+	if (workers == NULL || bs.queues == NULL)
+	{
+		fprintf(stderr, "%s\n", strerror(errno));
+		free(workers);
+		free(bs.queues);
+		return -1;
+	}
+	for (i = 0; i < jobs; i++)
+	{
+		pthread_mutex_init(&bs.queues[i].lock, NULL);
+	}
+
+	/* Every worker's buffer up front, so none of them can fail for lack of one */
+	for (started = 0; started < jobs; started++)
+	{
+		workers[started].bs = &bs;
+		workers[started].self = started;
+		if ((workers[started].buffer = arena_alloc(&workers[started].arena,
+			proto->block_size + 8)) == NULL)
+		{
+			fprintf(stderr, "%s\n", strerror(errno));
+			break;
+		}
+		if ((err = pthread_create(&workers[started].thread, NULL, batch_worker, &workers[started])) != 0)
+		{
+			fprintf(stderr, "%s\n", strerror(err));
+			arena_free(&workers[started].arena);
+			break;
+		}
+	}
+
+	/* The deques of workers that didn't start are stolen from */
+	count = started > 0 ? batch_read(&bs, list) : -1;
+
+	pthread_mutex_lock(&bs.lock);
+	bs.done = 1;
+	pthread_cond_broadcast(&bs.work);
+	pthread_mutex_unlock(&bs.lock);
+
+	for (i = 0; i < started; i++)
+	{
+		pthread_join(workers[i].thread, NULL);
+		arena_free(&workers[i].arena);
+	}
+	for (i = 0; i < jobs; i++)
+	{
+		pthread_mutex_destroy(&bs.queues[i].lock);
+	}
+	free(workers);
+	free(bs.queues);
+	pthread_cond_destroy(&bs.space);
+	pthread_cond_destroy(&bs.work);
+	pthread_mutex_destroy(&bs.lock);
+
+	if (bs.failed != 0 && count >= 0)
+	{
+		fprintf(stderr, "%lu of %ld files failed\n", bs.failed, count);
+	}
+	else if (bs.failed != 0)
+	{
+		fprintf(stderr, "%lu files failed\n", bs.failed);
+	}
+	return count < 0 || bs.failed != 0 ? -1 : 0;
+}
@@ -0,0 +1,166 @@
+/* crypto/bf/bf_cbc.c */
+/* Copyright (C) 1995-1997 Eric Young (eay@cryptsoft.com)
+ * All rights reserved.
+ *
+ * This package is an SSL implementation written
+ * by Eric Young (eay@cryptsoft.com).
+ * The implementation was written so as to conform with Netscapes SSL.
+ *
+ * This library is free for commercial and non-commercial use as long as
+ * the following conditions are aheared to.  The following conditions
+ * apply to all code found in this distribution, be it the RC4, RSA,
+ * lhash, DES, etc., code; not just the SSL code.  The SSL documentation
+ * included with this distribution is covered by the same copyright terms
+ * except that the holder is Tim Hudson (tjh@cryptsoft.com).
+ *
+ * Copyright remains Eric Young's, and as such any Copyright notices in
+ * the code are not to be removed.
+ * If this package is used in a product, Eric Young should be given attribution
+ * as the author of the parts of the library used.
+ * This can be in the form of a textual message at program startup or
+ * in documentation (online or textual) provided with the package.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    "This product includes cryptographic software written by
+ *     Eric Young (eay@cryptsoft.com)"
+ *    The word 'cryptographic' can be left out if the rouines from the library
+ *    being used are not cryptographic related :-).
+ * 4. If you include any Windows specific code (or a derivative thereof) from
+ *    the apps directory (application code) you must include an acknowledgement:
+ *    "This product includes software written by Tim Hudson (tjh@cryptsoft.com)"
+ *
+ * THIS SOFTWARE IS PROVIDED BY ERIC YOUNG ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * The licence and distribution terms for any publically available version or
+ * derivative of this code cannot be changed.  i.e. this code cannot simply be
+ * copied and put under another distribution licence
+ * [including the GNU Public Licence.]
+ */
+
+#include <string.h>
+#include "blowfish.h"
+#include "bf_locl.h"
+
+/* Number of blocks decrypted per call to BF_encrypt_blocks */
+#define BF_CBC_BATCH	32
+
+/* Encryption chains each block on the one before it and goes a block at
+ * a time; a partial last block is padded with zeros and a whole block
+ * written.  Decryption has no such chain, every block only needs the
+ * ciphertext block before it, so it is done in batches like CFB.  A
+ * partial last block writes only length % 8 bytes.  ivec ends up as the
+ * last ciphertext block either way, in may equal out.
+ */
+void
+BF_cbc_encrypt(in, out, length, ks, iv, encrypt)
+     unsigned char *in;
+     unsigned char *out;
+     long length;
+     BF_KEY *ks;
+     unsigned char *iv;
+     int encrypt;
+{
+  register BF_LONG tin0, tin1;
+  register BF_LONG tout0, tout1, xor0, xor1;
+  register long l = length;
+  BF_LONG tin[2];
+  uint64_t w, c, prev;
+
+  if (encrypt) {
+    n2l(iv, tout0);
+    n2l(iv, tout1);
+    iv -= 8;
+    for (l -= 8; l >= 0; l -= 8) {
+      n2l(in, tin0);
+      n2l(in, tin1);
+      tin0 ^= tout0;
+      tin1 ^= tout1;
+      tin[0] = tin0;
+      tin[1] = tin1;
+      BF_encrypt(tin, ks, BF_ENCRYPT);
+      tout0 = tin[0];
+      l2n(tout0, out);
+      tout1 = tin[1];
+      l2n(tout1, out);
+    }
+    if (l != -8) {
+      n2ln(in, tin0, tin1, l + 8);
+      tin0 ^= tout0;
+      tin1 ^= tout1;
+      tin[0] = tin0;
+      tin[1] = tin1;
+      BF_encrypt(tin, ks, BF_ENCRYPT);
+      tout0 = tin[0];
+      l2n(tout0, out);
+      tout1 = tin[1];
+      l2n(tout1, out);
+    }
+    l2n(tout0, iv);
+    l2n(tout1, iv);
+  } else {
+    BF_LONG d[2 * BF_CBC_BATCH];
+    unsigned char *p;
+    long i, nb;
+
+    p = iv;
+    n2ll(p, prev);
+    while (l >= BF_BLOCK) {
+      nb = l / BF_BLOCK;
+      if (nb > BF_CBC_BATCH)
+	nb = BF_CBC_BATCH;
+      p = in;
+      for (i = 0; i < nb; i++) {
+	n2l(p, d[2 * i]);
+	n2l(p, d[2 * i + 1]);
+      }
+      BF_encrypt_blocks(d, nb, ks, BF_DECRYPT);
+      /* each ciphertext block is loaded before out overwrites it */
+      for (i = 0; i < nb; i++) {
+	n2ll(in, c);
+	w = (((uint64_t) d[2 * i] << 32) | d[2 * i + 1]) ^ prev;
+	ll2n(w, out);
+	prev = c;
+      }
+      l -= nb * BF_BLOCK;
+    }
+    xor0 = (BF_LONG) (prev >> 32);
+    xor1 = (BF_LONG) prev;
+    if (l > 0) {
+      n2l(in, tin0);
+      n2l(in, tin1);
+      tin[0] = tin0;
+      tin[1] = tin1;
+      BF_encrypt(tin, ks, BF_DECRYPT);
+      tout0 = tin[0] ^ xor0;
+      tout1 = tin[1] ^ xor1;
+      l2nn(tout0, tout1, out, l);
+      xor0 = tin0;
+      xor1 = tin1;
+    }
+    l2n(xor0, iv);
+    l2n(xor1, iv);
+    memset(d, 0, sizeof(d));
+  }
+  tin0 = tin1 = tout0 = tout1 = xor0 = xor1 = 0;
+  tin[0] = tin[1] = 0;
+  w = c = prev = 0;
+}
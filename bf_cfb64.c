@@ -56,6 +56,7 @@
  * [including the GNU Public Licence.]
  */
 
+#include <string.h>
 #include "blowfish.h"
 #include "bf_locl.h"
 
@@ -64,6 +65,13 @@
  * 64bit block we have used is contained in *num;
  */
 
+/* Number of blocks decrypted per call to BF_encrypt_blocks */
+#define BF_CFB_BATCH	32
+
+/* Whole blocks are handled a 64 bit word at a time whenever n is 0 and
+ * at least one block remains; the byte loops only do the head and tail.
+ */
+
 void
 BF_cfb64_encrypt(in, out, length, schedule, ivec, num, encrypt)
      unsigned char *in;
@@ -78,11 +86,34 @@ BF_cfb64_encrypt(in, out, length, schedule, ivec, num, encrypt)
   register int n = *num;
   register long l = length;
   BF_LONG ti[2];
+  uint64_t w;
   unsigned char *iv, c, cc;
 
   iv = (unsigned char *) ivec;
   if (encrypt) {
-    while (l--) {
+    for (;;) {
+      if (n == 0 && l >= BF_BLOCK) {
+	n2l(iv, v0);
+	n2l(iv, v1);
+	do {
+	  ti[0] = v0;
+	  ti[1] = v1;
+	  BF_encrypt((BF_LONG *) ti, schedule, BF_ENCRYPT);
+	  n2ll(in, w);
+	  w ^= ((uint64_t) ti[0] << 32) | ti[1];
+	  ll2n(w, out);
+	  v0 = (BF_LONG) (w >> 32);
+	  v1 = (BF_LONG) w;
+	  l -= BF_BLOCK;
+	} while (l >= BF_BLOCK);
+	iv = (unsigned char *) ivec;
+	l2n(v0, iv);
+	l2n(v1, iv);
+	iv = (unsigned char *) ivec;
+	continue;
+      }
+      if (l-- == 0)
+	break;
       if (n == 0) {
 	n2l(iv, v0);
 	ti[0] = v0;
@@ -102,7 +133,40 @@ BF_cfb64_encrypt(in, out, length, schedule, ivec, num, encrypt)
       n = (n + 1) & 0x07;
     }
   } else {
-    while (l--) {
+    for (;;) {
+      /* The keystream for a block only depends on the ciphertext block
+       * before it, so whole blocks can be decrypted in batches */
+      if (n == 0 && l >= BF_BLOCK) {
+	BF_LONG ks[2 * BF_CFB_BATCH];
+	unsigned char *p = in;
+	long i, nb = l / BF_BLOCK;
+
+	if (nb > BF_CFB_BATCH)
+	  nb = BF_CFB_BATCH;
+	n2l(iv, v0);
+	ks[0] = v0;
+	n2l(iv, v1);
+	ks[1] = v1;
+	for (i = 1; i < nb; i++) {
+	  n2ll(p, w);
+	  ks[2 * i] = (BF_LONG) (w >> 32);
+	  ks[2 * i + 1] = (BF_LONG) w;
+	}
+	/* the last ciphertext block becomes the next iv, save it before
+	 * out overwrites it when in == out */
+	iv = (unsigned char *) ivec;
+	memcpy(iv, in + (nb - 1) * BF_BLOCK, BF_BLOCK);
+	BF_encrypt_blocks(ks, nb, schedule, BF_ENCRYPT);
+	for (i = 0; i < nb; i++) {
+	  n2ll(in, w);
+	  w ^= ((uint64_t) ks[2 * i] << 32) | ks[2 * i + 1];
+	  ll2n(w, out);
+	}
+	l -= nb * BF_BLOCK;
+	continue;
+      }
+      if (l-- == 0)
+	break;
       if (n == 0) {
 	n2l(iv, v0);
 	ti[0] = v0;
@@ -124,5 +188,6 @@ BF_cfb64_encrypt(in, out, length, schedule, ivec, num, encrypt)
     }
   }
   v0 = v1 = ti[0] = ti[1] = t = c = cc = 0;
+  w = 0;
   *num = n;
 }
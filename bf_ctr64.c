@@ -0,0 +1,84 @@
+/* bf_ctr64.c */
+/* Counter mode.  Block i of the keystream is the encryption of ivec + i,
+ * ivec being a 64 bit big endian counter.  Unlike CFB every block of the
+ * keystream can be computed on its own, so whole blocks go through
+ * BF_encrypt_blocks in batches whichever way the data is going, and a
+ * stream can be started at any block by adding to the counter.
+ */
+
+#include <string.h>
+#include "blowfish.h"
+#include "bf_locl.h"
+
+/* Number of keystream blocks made per call to BF_encrypt_blocks */
+#define BF_CTR_BATCH	32
+
+/* ivec is the counter for the next keystream block, ecount the current
+ * keystream block and *num how much of it has been used, much like the
+ * state BF_cfb64_encrypt keeps.  Encryption and decryption are the same.
+ */
+void
+BF_ctr64_encrypt(in, out, length, schedule, ivec, ecount, num)
+     unsigned char *in;
+     unsigned char *out;
+     long length;
+     BF_KEY *schedule;
+     unsigned char *ivec;
+     unsigned char *ecount;
+     int *num;
+{
+  register int n = *num;
+  register long l = length;
+  BF_LONG ks[2 * BF_CTR_BATCH];
+  uint64_t ctr, w;
+  unsigned char *iv;
+  long i, nb;
+
+  iv = ivec;
+  n2ll(iv, ctr);
+
+  /* use up what is left of the current keystream block */
+  while (n != 0 && l > 0) {
+    *(out++) = *(in++) ^ ecount[n];
+    n = (n + 1) & 0x07;
+    l--;
+  }
+
+  while (l >= BF_BLOCK) {
+    nb = l / BF_BLOCK;
+    if (nb > BF_CTR_BATCH)
+      nb = BF_CTR_BATCH;
+    for (i = 0; i < nb; i++, ctr++) {
+      ks[2 * i] = (BF_LONG) (ctr >> 32);
+      ks[2 * i + 1] = (BF_LONG) ctr;
+    }
+    BF_encrypt_blocks(ks, nb, schedule, BF_ENCRYPT);
+    for (i = 0; i < nb; i++) {
+      n2ll(in, w);
+      w ^= ((uint64_t) ks[2 * i] << 32) | ks[2 * i + 1];
+      ll2n(w, out);
+    }
+    l -= nb * BF_BLOCK;
+  }
+
+  /* a partial block at the end leaves its keystream in ecount */
+  if (l > 0) {
+    ks[0] = (BF_LONG) (ctr >> 32);
+    ks[1] = (BF_LONG) ctr;
+    ctr++;
+    BF_encrypt(ks, schedule, BF_ENCRYPT);
+    iv = ecount;
+    l2n(ks[0], iv);
+    l2n(ks[1], iv);
+    while (l-- > 0) {
+      *(out++) = *(in++) ^ ecount[n];
+      n++;
+    }
+  }
+
+  iv = ivec;
+  ll2n(ctr, iv);
+  memset(ks, 0, sizeof(ks));
+  w = 0;
+  *num = n;
+}
@@ -0,0 +1,244 @@
+/* bf_disp.c */
+/* Run time choice of the Blowfish kernels.  Every round variant from
+ * bf_locl.h is built into the binary (bf_enc.c once per variant) along
+ * with the vector kernels from bf_simd.c, and BF_encrypt and
+ * BF_encrypt_blocks call through whatever is selected here.
+ *
+ * Three things are selected independently: the kernel for single
+ * blocks, which chained modes such as CFB encryption are bound by, the
+ * scalar kernel for runs of independent blocks, and optionally a vector
+ * kernel that takes the whole vector groups of such runs first.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "blowfish.h"
+#include "bf_locl.h"
+
+typedef struct bf_kernel_st {
+  const char *name;
+  bf_encrypt_fn *encrypt;	/* NULL for the vector kernels */
+  bf_encrypt_blocks_fn *encrypt_blocks;
+  int width;			/* blocks per vector, 1 if scalar */
+  int (*supported) (void);	/* NULL if it runs everywhere */
+} BF_KERNEL_ST;
+
+static const BF_KERNEL_ST bf_kernels[] = {
+  {"ptr2", bf_encrypt_ptr2, bf_encrypt_blocks_ptr2, 1, NULL},
+  {"ptr", bf_encrypt_ptr, bf_encrypt_blocks_ptr, 1, NULL},
+  {"noptr", bf_encrypt_noptr, bf_encrypt_blocks_noptr, 1, NULL},
+#ifdef BF_SIMD_X86
+  {"avx2", NULL, bf_encrypt_blocks_avx2, 8, bf_cpu_has_avx2},
+  {"avx512", NULL, bf_encrypt_blocks_avx512, 16, bf_cpu_has_avx512},
+#endif
+};
+
+#define BF_NKERNELS	(sizeof(bf_kernels) / sizeof(bf_kernels[0]))
+
+/* Whatever bf_locl.h would have compiled in is the default */
+#if defined(BF_PTR2)
+#define BF_DEFAULT	0
+#elif defined(BF_PTR)
+#define BF_DEFAULT	1
+#else
+#define BF_DEFAULT	2
+#endif
+
+static const BF_KERNEL_ST *bf_single = &bf_kernels[BF_DEFAULT];
+static const BF_KERNEL_ST *bf_bulk = &bf_kernels[BF_DEFAULT];
+static const BF_KERNEL_ST *bf_vector = NULL;
+
+/* Blocks per timing run and runs per kernel in BF_bench_kernel */
+#define BF_BENCH_BLOCKS	4096
+#define BF_BENCH_RUNS	3
+
+static int
+bf_kernel_usable(const BF_KERNEL_ST *k)
+{
+  return k->supported == NULL || k->supported();
+}
+
+static const BF_KERNEL_ST *
+bf_find_kernel(const char *name, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < BF_NKERNELS; i++)
+    if (strlen(bf_kernels[i].name) == len &&
+	strncmp(bf_kernels[i].name, name, len) == 0)
+      return &bf_kernels[i];
+  return NULL;
+}
+
+/* Start out with the widest vector kernel the CPU has */
+#ifdef __GNUC__
+__attribute__((constructor))
+#endif
+static void
+bf_disp_init(void)
+{
+  size_t i;
+
+  for (i = 0; i < BF_NKERNELS; i++)
+    if (bf_kernels[i].width > 1 && bf_kernel_usable(&bf_kernels[i]))
+      bf_vector = &bf_kernels[i];
+}
+
+void
+BF_encrypt(BF_LONG *data, BF_KEY *key, int encrypt)
+{
+  bf_single->encrypt(data, key, encrypt);
+}
+
+void
+BF_encrypt_blocks(BF_LONG *data, size_t nblocks, BF_KEY *key, int encrypt)
+{
+  size_t done = 0;
+
+  if (bf_vector != NULL) {
+    bf_vector->encrypt_blocks(data, nblocks, key, encrypt);
+    done = nblocks - nblocks % bf_vector->width;
+  }
+  if (done < nblocks)
+    bf_bulk->encrypt_blocks(data + 2 * done, nblocks - done, key, encrypt);
+}
+
+/* The selection as "single,bulk,vector", vector being "none" if unused.
+ * This is also the form BF_set_kernel takes. */
+const char *
+BF_kernel(void)
+{
+  static char buf[64];
+
+  snprintf(buf, sizeof(buf), "%s,%s,%s", bf_single->name, bf_bulk->name,
+	   bf_vector != NULL ? bf_vector->name : "none");
+  return buf;
+}
+
+char *
+BF_options(void)
+{
+  static char buf[80];
+
+  snprintf(buf, sizeof(buf), "blowfish(%s)", BF_kernel());
+  return buf;
+}
+
+/* spec is either what BF_kernel returns, the name of a scalar kernel to
+ * use for both single blocks and runs, or the name of a vector kernel
+ * (or "none").  Returns 0 on success, -1 if a name is unknown or the
+ * CPU cannot run it, in which case nothing is changed. */
+int
+BF_set_kernel(const char *spec)
+{
+  const BF_KERNEL_ST *k[3];
+  const char *p = spec, *e;
+  int n;
+
+  for (n = 0; n < 3; n++) {
+    e = p + strcspn(p, ",");
+    if (e - p == 4 && strncmp(p, "none", 4) == 0)
+      k[n] = NULL;
+    else if ((k[n] = bf_find_kernel(p, e - p)) == NULL ||
+	     !bf_kernel_usable(k[n]))
+      return -1;
+    if (*e == '\0')
+      break;
+    p = e + 1;
+  }
+
+  if (n == 0) {
+    if (k[0] == NULL || k[0]->width > 1)
+      bf_vector = k[0];
+    else
+      bf_single = bf_bulk = k[0];
+    return 0;
+  }
+
+  if (n != 2 || k[0] == NULL || k[0]->width > 1 ||
+      k[1] == NULL || k[1]->width > 1 || (k[2] != NULL && k[2]->width == 1))
+    return -1;
+  bf_single = k[0];
+  bf_bulk = k[1];
+  bf_vector = k[2];
+  return 0;
+}
+
+static double
+bf_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Best of BF_BENCH_RUNS timings of either BF_BENCH_BLOCKS chained single
+ * block encryptions or one run of BF_BENCH_BLOCKS independent blocks */
+static double
+bf_time_kernel(const BF_KERNEL_ST *k, int single, BF_LONG *data,
+	       BF_KEY *key)
+{
+  double t, best = -1;
+  int i, run;
+
+  for (run = 0; run < BF_BENCH_RUNS; run++) {
+    t = bf_now();
+    if (single)
+      for (i = 0; i < BF_BENCH_BLOCKS; i++)
+	k->encrypt(data, key, BF_ENCRYPT);
+    else
+      k->encrypt_blocks(data, BF_BENCH_BLOCKS, key, BF_ENCRYPT);
+    t = bf_now() - t;
+    if (best < 0 || t < best)
+      best = t;
+  }
+  return best;
+}
+
+/* Times every kernel this CPU can run, selects the fastest for each of
+ * the three roles and returns the new selection as from BF_kernel.
+ * Takes a few milliseconds. */
+const char *
+BF_bench_kernel(void)
+{
+  static BF_LONG data[2 * BF_BENCH_BLOCKS];
+  BF_KEY key;
+  double t, single = -1, bulk = -1;
+  size_t i;
+
+  BF_set_key(&key, 8, (unsigned char *) "kernelbf");
+  for (i = 0; i < 2 * BF_BENCH_BLOCKS; i++)
+    data[i] = i;
+
+  for (i = 0; i < BF_NKERNELS; i++) {
+    if (bf_kernels[i].width > 1)
+      continue;
+    t = bf_time_kernel(&bf_kernels[i], 1, data, &key);
+    if (single < 0 || t < single) {
+      single = t;
+      bf_single = &bf_kernels[i];
+    }
+    t = bf_time_kernel(&bf_kernels[i], 0, data, &key);
+    if (bulk < 0 || t < bulk) {
+      bulk = t;
+      bf_bulk = &bf_kernels[i];
+    }
+  }
+
+  /* a vector kernel only gets used if it beats the best scalar one */
+  bf_vector = NULL;
+  for (i = 0; i < BF_NKERNELS; i++) {
+    if (bf_kernels[i].width == 1 || !bf_kernel_usable(&bf_kernels[i]))
+      continue;
+    t = bf_time_kernel(&bf_kernels[i], 0, data, &key);
+    if (t < bulk) {
+      bulk = t;
+      bf_vector = &bf_kernels[i];
+    }
+  }
+
+  memset(&key, 0, sizeof(key));
+  return BF_kernel();
+}
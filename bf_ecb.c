@@ -0,0 +1,121 @@
+/* crypto/bf/bf_ecb.c */
+/* Copyright (C) 1995-1997 Eric Young (eay@cryptsoft.com)
+ * All rights reserved.
+ *
+ * This package is an SSL implementation written
+ * by Eric Young (eay@cryptsoft.com).
+ * The implementation was written so as to conform with Netscapes SSL.
+ *
+ * This library is free for commercial and non-commercial use as long as
+ * the following conditions are aheared to.  The following conditions
+ * apply to all code found in this distribution, be it the RC4, RSA,
+ * lhash, DES, etc., code; not just the SSL code.  The SSL documentation
+ * included with this distribution is covered by the same copyright terms
+ * except that the holder is Tim Hudson (tjh@cryptsoft.com).
+ *
+ * Copyright remains Eric Young's, and as such any Copyright notices in
+ * the code are not to be removed.
+ * If this package is used in a product, Eric Young should be given attribution
+ * as the author of the parts of the library used.
+ * This can be in the form of a textual message at program startup or
+ * in documentation (online or textual) provided with the package.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    "This product includes cryptographic software written by
+ *     Eric Young (eay@cryptsoft.com)"
+ *    The word 'cryptographic' can be left out if the rouines from the library
+ *    being used are not cryptographic related :-).
+ * 4. If you include any Windows specific code (or a derivative thereof) from
+ *    the apps directory (application code) you must include an acknowledgement:
+ *    "This product includes software written by Tim Hudson (tjh@cryptsoft.com)"
+ *
+ * THIS SOFTWARE IS PROVIDED BY ERIC YOUNG ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * The licence and distribution terms for any publically available version or
+ * derivative of this code cannot be changed.  i.e. this code cannot simply be
+ * copied and put under another distribution licence
+ * [including the GNU Public Licence.]
+ */
+
+#include "blowfish.h"
+#include "bf_locl.h"
+
+/* Blowfish as implemented from 'Blowfish: Springer-Verlag paper'
+ * (From LECTURE NOTES IN COIMPUTER SCIENCE 809, FAST SOFTWARE ENCRYPTION,
+ * CAMBRIDGE SECURITY WORKSHOP, CAMBRIDGE, U.K., DECEMBER 9-11, 1993)
+ */
+
+/* Number of blocks per call to BF_encrypt_blocks */
+#define BF_ECB_BATCH	32
+
+void
+BF_ecb_encrypt(in, out, ks, encrypt)
+     unsigned char *in;
+     unsigned char *out;
+     BF_KEY *ks;
+     int encrypt;
+{
+  BF_LONG l, d[2];
+
+  n2l(in, l);
+  d[0] = l;
+  n2l(in, l);
+  d[1] = l;
+  BF_encrypt(d, ks, encrypt);
+  l = d[0];
+  l2n(l, out);
+  l = d[1];
+  l2n(l, out);
+  l = d[0] = d[1] = 0;
+}
+
+/* The length / 8 whole blocks at in, encrypted or decrypted onto out in
+ * batches so the interleaved and vector kernels get used.  Any bytes
+ * past the last whole block are left alone.  in may equal out.
+ */
+void
+BF_ecb_encrypt_blocks(in, out, length, ks, encrypt)
+     unsigned char *in;
+     unsigned char *out;
+     long length;
+     BF_KEY *ks;
+     int encrypt;
+{
+  BF_LONG d[2 * BF_ECB_BATCH];
+  long i, nb, l = length / BF_BLOCK;
+
+  while (l > 0) {
+    nb = l > BF_ECB_BATCH ? BF_ECB_BATCH : l;
+    for (i = 0; i < nb; i++) {
+      n2l(in, d[2 * i]);
+      n2l(in, d[2 * i + 1]);
+    }
+    BF_encrypt_blocks(d, nb, ks, encrypt);
+    for (i = 0; i < nb; i++) {
+      l2n(d[2 * i], out);
+      l2n(d[2 * i + 1], out);
+    }
+    l -= nb;
+  }
+  for (i = 0; i < 2 * BF_ECB_BATCH; i++)
+    d[i] = 0;
+}
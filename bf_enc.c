@@ -69,8 +69,10 @@ If you set BF_ROUNDS to some value other than 16 or 20, you will have
   to modify the code.
 #endif
 
+/* Built once per round variant, see bf_locl.h; BF_encrypt itself is
+ * the dispatcher in bf_disp.c */
 void
-BF_encrypt(data, key, encrypt)
+BF_KERNEL(bf_encrypt)(data, key, encrypt)
      BF_LONG *data;
      BF_KEY *key;
      int encrypt;
@@ -136,3 +138,115 @@ BF_encrypt(data, key, encrypt)
   data[1] = l & 0xffffffffL;
   data[0] = r & 0xffffffffL;
 }
+
+/* Four blocks run through the rounds in lockstep.  A single block is
+ * bound by the latency of each round's S-box loads on the previous
+ * round, so interleaving independent blocks lets those loads overlap. */
+#define BF_ENC4(LL,R,S,P) \
+	{ \
+	BF_ENC(LL##0,R##0,S,P); \
+	BF_ENC(LL##1,R##1,S,P); \
+	BF_ENC(LL##2,R##2,S,P); \
+	BF_ENC(LL##3,R##3,S,P); \
+	}
+
+/* Encrypt or decrypt nblocks independent blocks laid out as for
+ * BF_encrypt, i.e. data[2*i] and data[2*i+1] hold block i */
+void
+BF_KERNEL(bf_encrypt_blocks)(data, nblocks, key, encrypt)
+     BF_LONG *data;
+     size_t nblocks;
+     BF_KEY *key;
+     int encrypt;
+{
+  register BF_LONG l0, r0, l1, r1, l2, r2, l3, r3, *p, *s;
+
+  p = key->P;
+  s = &(key->S[0]);
+
+  for (; nblocks >= 4; nblocks -= 4, data += 8) {
+    l0 = data[0];
+    r0 = data[1];
+    l1 = data[2];
+    r1 = data[3];
+    l2 = data[4];
+    r2 = data[5];
+    l3 = data[6];
+    r3 = data[7];
+
+    if (encrypt) {
+      l0 ^= p[0];
+      l1 ^= p[0];
+      l2 ^= p[0];
+      l3 ^= p[0];
+      BF_ENC4(r, l, s, p[1]);
+      BF_ENC4(l, r, s, p[2]);
+      BF_ENC4(r, l, s, p[3]);
+      BF_ENC4(l, r, s, p[4]);
+      BF_ENC4(r, l, s, p[5]);
+      BF_ENC4(l, r, s, p[6]);
+      BF_ENC4(r, l, s, p[7]);
+      BF_ENC4(l, r, s, p[8]);
+      BF_ENC4(r, l, s, p[9]);
+      BF_ENC4(l, r, s, p[10]);
+      BF_ENC4(r, l, s, p[11]);
+      BF_ENC4(l, r, s, p[12]);
+      BF_ENC4(r, l, s, p[13]);
+      BF_ENC4(l, r, s, p[14]);
+      BF_ENC4(r, l, s, p[15]);
+      BF_ENC4(l, r, s, p[16]);
+#if BF_ROUNDS == 20
+      BF_ENC4(r, l, s, p[17]);
+      BF_ENC4(l, r, s, p[18]);
+      BF_ENC4(r, l, s, p[19]);
+      BF_ENC4(l, r, s, p[20]);
+#endif
+      r0 ^= p[BF_ROUNDS + 1];
+      r1 ^= p[BF_ROUNDS + 1];
+      r2 ^= p[BF_ROUNDS + 1];
+      r3 ^= p[BF_ROUNDS + 1];
+    } else {
+      l0 ^= p[BF_ROUNDS + 1];
+      l1 ^= p[BF_ROUNDS + 1];
+      l2 ^= p[BF_ROUNDS + 1];
+      l3 ^= p[BF_ROUNDS + 1];
+#if BF_ROUNDS == 20
+      BF_ENC4(r, l, s, p[20]);
+      BF_ENC4(l, r, s, p[19]);
+      BF_ENC4(r, l, s, p[18]);
+      BF_ENC4(l, r, s, p[17]);
+#endif
+      BF_ENC4(r, l, s, p[16]);
+      BF_ENC4(l, r, s, p[15]);
+      BF_ENC4(r, l, s, p[14]);
+      BF_ENC4(l, r, s, p[13]);
+      BF_ENC4(r, l, s, p[12]);
+      BF_ENC4(l, r, s, p[11]);
+      BF_ENC4(r, l, s, p[10]);
+      BF_ENC4(l, r, s, p[9]);
+      BF_ENC4(r, l, s, p[8]);
+      BF_ENC4(l, r, s, p[7]);
+      BF_ENC4(r, l, s, p[6]);
+      BF_ENC4(l, r, s, p[5]);
+      BF_ENC4(r, l, s, p[4]);
+      BF_ENC4(l, r, s, p[3]);
+      BF_ENC4(r, l, s, p[2]);
+      BF_ENC4(l, r, s, p[1]);
+      r0 ^= p[0];
+      r1 ^= p[0];
+      r2 ^= p[0];
+      r3 ^= p[0];
+    }
+    data[1] = l0 & 0xffffffffL;
+    data[0] = r0 & 0xffffffffL;
+    data[3] = l1 & 0xffffffffL;
+    data[2] = r1 & 0xffffffffL;
+    data[5] = l2 & 0xffffffffL;
+    data[4] = r2 & 0xffffffffL;
+    data[7] = l3 & 0xffffffffL;
+    data[6] = r3 & 0xffffffffL;
+  }
+
+  for (; nblocks > 0; nblocks--, data += 2)
+    BF_KERNEL(bf_encrypt)(data, key, encrypt);
+}
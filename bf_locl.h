@@ -70,6 +70,8 @@
  * optimization options.  Older Sparc's work better with only UNROLL, but
  * there's no way to tell at compile time what it is you're running on */
 
+#if !defined(BF_PTR) && !defined(BF_PTR2) && !defined(BF_NOPTR)
+#define BF_PICK_DEFAULT
 #if defined( sun )		/* Newer Sparc's */
 #define BF_PTR
 #elif defined( __ultrix )	/* Older MIPS */
@@ -91,6 +93,7 @@
 #elif defined( _MSC_VER )	/* x86 boxes, Visual C */
 #define BF_PTR2
 #endif /* Systems-specific speed defines */
+#endif
 
 #undef c2l
 #define c2l(c,l)	(l =((unsigned long)(*((c)++)))    , \
@@ -180,26 +183,83 @@
                          *((c)++)=(unsigned char)(((l)>> 8L)&0xff), \
                          *((c)++)=(unsigned char)(((l)     )&0xff))
 
+/* A whole block as one big endian 64 bit word, with a single byte
+ * swapped load or store where the compiler makes that easy.  These are
+ * statements and need <string.h>; c is incremented as per n2l/l2n. */
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define n2ll(c,ll)	{ memcpy(&(ll),(c),8); (ll)=__builtin_bswap64(ll); \
+			  (c)+=8; }
+#define ll2n(ll,c)	{ uint64_t w_=__builtin_bswap64(ll); \
+			  memcpy((c),&w_,8); (c)+=8; }
+#elif defined(__GNUC__) && defined(__BYTE_ORDER__) && \
+    __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define n2ll(c,ll)	{ memcpy(&(ll),(c),8); (c)+=8; }
+#define ll2n(ll,c)	{ uint64_t w_=(ll); memcpy((c),&w_,8); (c)+=8; }
+#else
+#define n2ll(c,ll)	{ unsigned long h_,l_; n2l(c,h_); n2l(c,l_); \
+			  (ll)=((uint64_t)h_<<32)|l_; }
+#define ll2n(ll,c)	{ unsigned long h_=(unsigned long)((ll)>>32), \
+			  l_=(unsigned long)((ll)&0xffffffffL); \
+			  l2n(h_,c); l2n(l_,c); }
+#endif
+
 /* This is actually a big endian algorithm, the most significate byte
  * is used to lookup array 0 */
 
 /* use BF_PTR2 for intel boxes,
  * BF_PTR for sparc and MIPS/SGI
- * use nothing for Alpha and HP.
+ * use nothing (BF_NOPTR) for Alpha and HP.
+ *
+ * bf_enc.c is compiled once for each of the three with the define given
+ * on the command line (see the Makefile) and bf_disp.c picks one at run
+ * time.  What gets chosen here when none is given is only the default
+ * until BF_set_kernel or BF_bench_kernel says otherwise.
  */
-#if !defined(BF_PTR) && !defined(BF_PTR2)
+/* With none given, a system the table at the top doesn't pick one for,
+ * even one marked None, gets BF_PTR; BF_NOPTR is only ever what the
+ * command line asks for */
+#if defined(BF_PICK_DEFAULT) && !defined(BF_PTR) && !defined(BF_PTR2)
 #define BF_PTR
 #endif
 
-#ifdef _LP64
-#undef BF_PTR
+/* log2(sizeof(BF_LONG)) */
+#define BF_LONG_LOG2	2
+
+/* Name the kernels in bf_enc.c after the variant they are built as */
+#if defined(BF_PTR2)
+#define BF_KERNEL(f)	f##_ptr2
+#elif defined(BF_PTR)
+#define BF_KERNEL(f)	f##_ptr
+#else
+#define BF_KERNEL(f)	f##_noptr
+#endif
+
+typedef void bf_encrypt_fn(BF_LONG *data, BF_KEY *key, int encrypt);
+typedef void bf_encrypt_blocks_fn(BF_LONG *data, size_t nblocks,
+				  BF_KEY *key, int encrypt);
+
+bf_encrypt_fn bf_encrypt_ptr2, bf_encrypt_ptr, bf_encrypt_noptr;
+bf_encrypt_blocks_fn bf_encrypt_blocks_ptr2, bf_encrypt_blocks_ptr,
+  bf_encrypt_blocks_noptr;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BF_SIMD_X86
+
+/* bf_simd.c: these only do the leading nblocks rounded down to a
+ * multiple of 8 (avx2) or 16 (avx512) blocks and leave the rest */
+bf_encrypt_blocks_fn bf_encrypt_blocks_avx2, bf_encrypt_blocks_avx512;
+int bf_cpu_has_avx2(void);
+int bf_cpu_has_avx512(void);
 #endif
 
-#define BF_M	0x3fc
-#define BF_0	22L
-#define BF_1	14L
-#define BF_2	 6L
-#define BF_3	 2L		/* left shift */
+/* The pointer versions index S with byte offsets, so the masks and
+ * shifts depend on the size of a BF_LONG */
+#define BF_M	(0xffL << BF_LONG_LOG2)
+#define BF_0	(24L - BF_LONG_LOG2)
+#define BF_1	(16L - BF_LONG_LOG2)
+#define BF_2	( 8L - BF_LONG_LOG2)
+#define BF_3	BF_LONG_LOG2	/* left shift */
 
 #if defined(BF_PTR2)
 
@@ -0,0 +1,170 @@
+/* bf_simd.c */
+/* Gather based versions of the BF_ENC round from bf_locl.h that run 8
+ * (AVX2) or 16 (AVX-512) independent blocks at once, one block per
+ * vector lane.  The S-box lookups are done with vpgatherdd against the
+ * four 256 entry tables in BF_KEY.S.
+ *
+ * The kernels are compiled with per-function target attributes and
+ * bf_disp.c only selects them when the running CPU reports support, so
+ * the objects still run anywhere.  Blocks that do not fill a vector are
+ * left to the scalar kernels.
+ */
+
+#include <stdint.h>
+#include "blowfish.h"
+#include "bf_locl.h"
+
+#ifdef BF_SIMD_X86
+
+#include <immintrin.h>
+
+/* Gather scale, i.e. the size of an S-box entry */
+#define BF_GSCALE	((int) sizeof(BF_LONG))
+
+#define BF_ENC_AVX2(LL,R,S,P) \
+	{ \
+	__m256i t_,a_,b_,c_,d_; \
+	a_=_mm256_srli_epi32(R,24); \
+	b_=_mm256_and_si256(_mm256_srli_epi32(R,16),m_); \
+	c_=_mm256_and_si256(_mm256_srli_epi32(R, 8),m_); \
+	d_=_mm256_and_si256(R,m_); \
+	t_=_mm256_add_epi32( \
+		_mm256_i32gather_epi32((const int *)&(S[  0]),a_,BF_GSCALE), \
+		_mm256_i32gather_epi32((const int *)&(S[256]),b_,BF_GSCALE)); \
+	t_=_mm256_xor_si256(t_, \
+		_mm256_i32gather_epi32((const int *)&(S[512]),c_,BF_GSCALE)); \
+	t_=_mm256_add_epi32(t_, \
+		_mm256_i32gather_epi32((const int *)&(S[768]),d_,BF_GSCALE)); \
+	LL=_mm256_xor_si256(LL,_mm256_set1_epi32((int)(P))); \
+	LL=_mm256_xor_si256(LL,t_); \
+	}
+
+#define BF_ENC_AVX512(LL,R,S,P) \
+	{ \
+	__m512i t_,a_,b_,c_,d_; \
+	a_=_mm512_srli_epi32(R,24); \
+	b_=_mm512_and_si512(_mm512_srli_epi32(R,16),m_); \
+	c_=_mm512_and_si512(_mm512_srli_epi32(R, 8),m_); \
+	d_=_mm512_and_si512(R,m_); \
+	t_=_mm512_add_epi32( \
+		_mm512_i32gather_epi32(a_,(const int *)&(S[  0]),BF_GSCALE), \
+		_mm512_i32gather_epi32(b_,(const int *)&(S[256]),BF_GSCALE)); \
+	t_=_mm512_xor_si512(t_, \
+		_mm512_i32gather_epi32(c_,(const int *)&(S[512]),BF_GSCALE)); \
+	t_=_mm512_add_epi32(t_, \
+		_mm512_i32gather_epi32(d_,(const int *)&(S[768]),BF_GSCALE)); \
+	LL=_mm512_xor_si512(LL,_mm512_set1_epi32((int)(P))); \
+	LL=_mm512_xor_si512(LL,t_); \
+	}
+
+__attribute__((target("avx2")))
+void
+bf_encrypt_blocks_avx2(BF_LONG *data, size_t nblocks, BF_KEY *key,
+		       int encrypt)
+{
+  uint32_t lv[8] __attribute__((aligned(32)));
+  uint32_t rv[8] __attribute__((aligned(32)));
+  const __m256i m_ = _mm256_set1_epi32(0xff);
+  __m256i l, r;
+  BF_LONG *p, *s;
+  int i;
+
+  p = key->P;
+  s = &(key->S[0]);
+
+  for (; nblocks >= 8; nblocks -= 8, data += 16) {
+    for (i = 0; i < 8; i++) {
+      lv[i] = (uint32_t) data[2 * i];
+      rv[i] = (uint32_t) data[2 * i + 1];
+    }
+    l = _mm256_load_si256((const __m256i *) lv);
+    r = _mm256_load_si256((const __m256i *) rv);
+
+    if (encrypt) {
+      l = _mm256_xor_si256(l, _mm256_set1_epi32((int) p[0]));
+      for (i = 1; i <= BF_ROUNDS; i += 2) {
+	BF_ENC_AVX2(r, l, s, p[i]);
+	BF_ENC_AVX2(l, r, s, p[i + 1]);
+      }
+      r = _mm256_xor_si256(r, _mm256_set1_epi32((int) p[BF_ROUNDS + 1]));
+    } else {
+      l = _mm256_xor_si256(l, _mm256_set1_epi32((int) p[BF_ROUNDS + 1]));
+      for (i = BF_ROUNDS; i >= 1; i -= 2) {
+	BF_ENC_AVX2(r, l, s, p[i]);
+	BF_ENC_AVX2(l, r, s, p[i - 1]);
+      }
+      r = _mm256_xor_si256(r, _mm256_set1_epi32((int) p[0]));
+    }
+
+    _mm256_store_si256((__m256i *) lv, l);
+    _mm256_store_si256((__m256i *) rv, r);
+    for (i = 0; i < 8; i++) {
+      data[2 * i + 1] = lv[i];
+      data[2 * i] = rv[i];
+    }
+  }
+}
+
+__attribute__((target("avx512f")))
+void
+bf_encrypt_blocks_avx512(BF_LONG *data, size_t nblocks, BF_KEY *key,
+			 int encrypt)
+{
+  uint32_t lv[16] __attribute__((aligned(64)));
+  uint32_t rv[16] __attribute__((aligned(64)));
+  const __m512i m_ = _mm512_set1_epi32(0xff);
+  __m512i l, r;
+  BF_LONG *p, *s;
+  int i;
+
+  p = key->P;
+  s = &(key->S[0]);
+
+  for (; nblocks >= 16; nblocks -= 16, data += 32) {
+    for (i = 0; i < 16; i++) {
+      lv[i] = (uint32_t) data[2 * i];
+      rv[i] = (uint32_t) data[2 * i + 1];
+    }
+    l = _mm512_load_si512((const void *) lv);
+    r = _mm512_load_si512((const void *) rv);
+
+    if (encrypt) {
+      l = _mm512_xor_si512(l, _mm512_set1_epi32((int) p[0]));
+      for (i = 1; i <= BF_ROUNDS; i += 2) {
+	BF_ENC_AVX512(r, l, s, p[i]);
+	BF_ENC_AVX512(l, r, s, p[i + 1]);
+      }
+      r = _mm512_xor_si512(r, _mm512_set1_epi32((int) p[BF_ROUNDS + 1]));
+    } else {
+      l = _mm512_xor_si512(l, _mm512_set1_epi32((int) p[BF_ROUNDS + 1]));
+      for (i = BF_ROUNDS; i >= 1; i -= 2) {
+	BF_ENC_AVX512(r, l, s, p[i]);
+	BF_ENC_AVX512(l, r, s, p[i - 1]);
+      }
+      r = _mm512_xor_si512(r, _mm512_set1_epi32((int) p[0]));
+    }
+
+    _mm512_store_si512((void *) lv, l);
+    _mm512_store_si512((void *) rv, r);
+    for (i = 0; i < 16; i++) {
+      data[2 * i + 1] = lv[i];
+      data[2 * i] = rv[i];
+    }
+  }
+}
+
+int
+bf_cpu_has_avx2(void)
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") != 0;
+}
+
+int
+bf_cpu_has_avx512(void)
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx512f") != 0;
+}
+
+#endif
@@ -59,6 +59,9 @@
 #ifndef HEADER_BLOWFISH_H
 #define HEADER_BLOWFISH_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef  __cplusplus
 extern "C" {
 #endif
@@ -66,45 +69,67 @@ extern "C" {
 #define BF_ENCRYPT	1
 #define BF_DECRYPT	0
 
-/* If you make this 'unsigned int' the pointer variants will work on
- * the Alpha, otherwise they will not.  Strangly using the '8 byte'
- * BF_LONG and the default 'non-pointer' inner loop is the best configuration
- * for the Alpha */
-#define BF_LONG unsigned long
+/* The algorithm only ever needs 32 bits.  An 8 byte BF_LONG doubles the
+ * key schedule to 8K for nothing, which then competes with everything
+ * else for L1 in the round function.  This breaks the ABI of SSLeay's
+ * header, where it was unsigned long, though not the API: anything built
+ * against that has to be rebuilt. */
+#define BF_LONG uint32_t
 
 #define BF_ROUNDS	16
 #define BF_BLOCK	8
 
+/* Keep each S-box starting on a cache line */
+#if defined(__GNUC__)
+#define BF_CACHE_ALIGN	__attribute__((aligned(64)))
+#else
+#define BF_CACHE_ALIGN
+#endif
+
   typedef struct bf_key_st {
     BF_LONG P[BF_ROUNDS + 2];
-    BF_LONG S[4 * 256];
+    BF_LONG S[4 * 256] BF_CACHE_ALIGN;
   } BF_KEY;
 
-  BF_KEY key;
-
 #ifndef NOPROTO
 
   void BF_set_key(BF_KEY * key, int len, unsigned char *data);
   void BF_ecb_encrypt(unsigned char *in, unsigned char *out, BF_KEY * key,
 		      int enc);
+  void BF_ecb_encrypt_blocks(unsigned char *in, unsigned char *out,
+			     long length, BF_KEY * key, int enc);
   void BF_encrypt(BF_LONG * data, BF_KEY * key, int enc);
+  void BF_encrypt_blocks(BF_LONG * data, size_t nblocks, BF_KEY * key,
+			 int enc);
   void BF_cbc_encrypt(unsigned char *in, unsigned char *out, long length,
 		      BF_KEY * ks, unsigned char *iv, int enc);
   void BF_cfb64_encrypt(unsigned char *in, unsigned char *out, long length,
 		 BF_KEY * schedule, unsigned char *ivec, int *num, int enc);
   void BF_ofb64_encrypt(unsigned char *in, unsigned char *out, long length,
 			BF_KEY * schedule, unsigned char *ivec, int *num);
+  void BF_ctr64_encrypt(unsigned char *in, unsigned char *out, long length,
+			BF_KEY * schedule, unsigned char *ivec,
+			unsigned char *ecount, int *num);
   char *BF_options(void);
+  const char *BF_kernel(void);
+  int BF_set_kernel(const char *spec);
+  const char *BF_bench_kernel(void);
 
 #else
 
   void BF_set_key();
   void BF_ecb_encrypt();
+  void BF_ecb_encrypt_blocks();
   void BF_encrypt();
+  void BF_encrypt_blocks();
   void BF_cbc_encrypt();
   void BF_cfb64_encrypt();
   void BF_ofb64_encrypt();
+  void BF_ctr64_encrypt();
   char *BF_options();
+  const char *BF_kernel();
+  int BF_set_kernel();
+  const char *BF_bench_kernel();
 
 #endif
 
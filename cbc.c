@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "cipher.h"
+
+/*
+ * CBC only works on whole blocks, so unlike the other modes the data is
+ * padded: PKCS#7, i.e. 1 to 8 bytes each holding the number of bytes
+ * added, which is what openssl and most other tools write
+ */
+
+/*
+ * Returns the number of padding bytes at the end of the decrypted block,
+ * or -1 if it isn't valid padding (wrong password or not CBC data)
+ */
+static int cbc_pad_length(const unsigned char *block)
+{
+	int pad = block[7];
+	int i;
+
+	if (pad < 1 || pad > 8)
+	{
+		return -1;
+	}
+	for (i = 8 - pad; i < 8; i++)
+	{
+		if (block[i] != pad)
+		{
+			return -1;
+		}
+	}
+	return pad;
+}
+
+/*
+ * The loop of cbc_crypt_serial, buffer has room for ctx->block_size + 8
+ * bytes (the block size is a multiple of 8) and held for the last
+ * decrypted block
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+static int cbc_loop(const struct crypt_ctx *ctx, struct stream *st, unsigned char *buffer,
+	unsigned char *held)
+{
+	struct writebehind wb;
+	size_t held_len = 0;
+	ssize_t bytes_read;
+	size_t len;
+	int pad;
+
+	wb_init(&wb, ctx->outfile_des);
+	do
+	{
+		if ((bytes_read = read_full(ctx->infile_des, buffer, ctx->block_size)) < 0)
+		{
+			perror(ctx->infile);
+			return -1;
+		}
+		len = bytes_read;
+
+		if (ctx->enc)
+		{
+			if (len < ctx->block_size)
+			{
+				pad = 8 - len % 8;
+				memset(buffer + len, pad, pad);
+				len += pad;
+			}
+			stream_crypt(st, buffer, buffer, len);
+			if (write_full(ctx->outfile_des, buffer, len) < 0)
+			{
+				perror(ctx->outfile);
+				return -1;
+			}
+			wb_advance(&wb, len);
+		}
+		else if (len > 0)
+		{
+			if (len % 8 != 0)
+			{
+				fprintf(stderr, "%s: not a multiple of the block size, truncated?\n", ctx->infile);
+				return -1;
+			}
+			stream_crypt(st, buffer, buffer, len);
+			/* The last block of the data is only written once its padding is off */
+			if (write_full(ctx->outfile_des, held, held_len) < 0 ||
+				write_full(ctx->outfile_des, buffer, len - 8) < 0)
+			{
+				perror(ctx->outfile);
+				return -1;
+			}
+			wb_advance(&wb, held_len + len - 8);
+			memcpy(held, buffer + len - 8, 8);
+			held_len = 8;
+		}
+	} while ((size_t) bytes_read == ctx->block_size);
+
+	if (!ctx->enc)
+	{
+		if (held_len == 0 || (pad = cbc_pad_length(held)) < 0)
+		{
+			fprintf(stderr, "%s: bad padding, wrong password or not CBC data\n", ctx->infile);
+			return -1;
+		}
+		if (write_full(ctx->outfile_des, held, 8 - pad) < 0)
+		{
+			perror(ctx->outfile);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Reads ctx->infile to the end, padding it and encrypting or checking and
+ * stripping the padding and decrypting, onto ctx->outfile
+ * Works on pipes; every read but the last fills the whole buffer, so only
+ * the last one can end in a partial block
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+int cbc_crypt_serial(const struct crypt_ctx *ctx)
+{
+	struct arena arena;
+	unsigned char *buffer;
+	int ret;
+
+	/* Room for a block of padding at the end */
+	if ((buffer = arena_alloc(&arena, ctx->block_size + 8)) == NULL)
+	{
+		fprintf(stderr, "%s\n", strerror(errno));
+		return -1;
+	}
+
+	ret = cbc_crypt(ctx, buffer);
+
+	arena_free(&arena);
+	return ret;
+}
+
+/*
+ * cbc_crypt_serial with a buffer of ctx->block_size + 8 bytes from the
+ * caller, who runs through many files with it
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+int cbc_crypt(const struct crypt_ctx *ctx, unsigned char *buffer)
+{
+	struct stream st;
+	unsigned char held[8];
+	int ret;
+
+	stream_init(&st, ctx);
+
+	ret = cbc_loop(ctx, &st, buffer, held);
+
+	memset(held, 0, sizeof(held));
+	memset(&st, 0, sizeof(st));
+	return ret;
+}
+
+/*
+ * Works out how much data the size bytes of CBC ciphertext in ctx->infile
+ * decrypt to by decrypting the last block and looking at its padding
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+int cbc_data_size(const struct crypt_ctx *ctx, off_t size, off_t *data_size)
+{
+	struct stream st;
+	unsigned char block[8];
+	int pad;
+
+	if (size < 8 || size % 8 != 0)
+	{
+		fprintf(stderr, "%s: not a multiple of the block size, truncated?\n", ctx->infile);
+		return -1;
+	}
+	stream_init(&st, ctx);
+	if (stream_seek(&st, ctx, size - 8) < 0 ||
+		pread_full(ctx->infile_des, block, 8, ctx->in_base + size - 8) != 8)
+	{
+		perror(ctx->infile);
+		return -1;
+	}
+	stream_crypt(&st, block, block, 8);
+	pad = cbc_pad_length(block);
+	memset(block, 0, sizeof(block));
+	memset(&st, 0, sizeof(st));
+	if (pad < 0)
+	{
+		fprintf(stderr, "%s: bad padding, wrong password or not CBC data\n", ctx->infile);
+		return -1;
+	}
+	*data_size = size - pad;
+	return 0;
+}
+
+/*
+ * Cuts the padding off the end of outfile after crypt_parallel has
+ * decrypted all of infile onto it
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+int cbc_truncate(const struct crypt_ctx *ctx)
+{
+	off_t size;
+	off_t data_size;
+
+	if ((size = lseek(ctx->infile_des, 0, SEEK_END)) < 0)
+	{
+		perror(ctx->infile);
+		return -1;
+	}
+	if (cbc_data_size(ctx, size - ctx->in_base, &data_size) < 0)
+	{
+		return -1;
+	}
+	if (ftruncate(ctx->outfile_des, ctx->out_base + data_size) < 0)
+	{
+		perror(ctx->outfile);
+		return -1;
+	}
+	return 0;
+}
@@ -2,28 +2,44 @@
 #include <pwd.h>
 #include <unistd.h>
 #include <string.h>
-#include "blowfish.h"
+#include "cipher.h"
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/stat.h>
 #include <stdlib.h>
 #include <sysexits.h>
 #include <sys/statvfs.h>
+#include <limits.h>
+#include <getopt.h>
 
 void print_usage(void);
-void check_files(const char *infile, const int infile_des, const char *outfile, const int outfile_des);
-void open_files(const char *infile, const char *outfile, int *infile_des, int *outfile_des);
-void encdec_file(const char *infile, const char *outfile, char *password, const int enc_flag);
-void close_file(const char *file, int file_des);
+int get_cpu_model(char *model, size_t size);
+void select_kernel(void);
+void check_files(const char *infile, const int infile_des, const char *outfile, const int outfile_des,
+	int devices);
+void open_files(const char *infile, const char *outfile, int *infile_des, int *outfile_des,
+	int out_access, int *created);
+int parse_range(const char *arg, off_t *offset, off_t *length);
+int parse_iv(const char *arg, unsigned char *iv);
+int parse_size(const char *arg, size_t *size);
+void encdec_file(const char *infile, const char *outfile, char *password, const int enc_flag,
+	const struct encdec_opts *opts);
+void abort_encdec(const char *infile, int infile_des, const char *outfile, int outfile_des);
+void inplace_file(const char *file, char *password, const int enc_flag,
+	const struct encdec_opts *opts);
+void verify_file(const char *infile, char *password, const struct encdec_opts *opts);
+void batch_files(char *password, const int enc_flag, const struct encdec_opts *opts);
+void archive_file(const char *infile, const char *outfile, char *password, const int enc_flag,
+	const struct encdec_opts *opts, const char *member);
 
 /*
  * Entry point of program
- * Handles arguments with getopt and any argument errors
+ * Handles arguments with getopt_long and any argument errors
  * Also handles password creation
  */
 int main(int argc, char *argv[])
 {
-	char arg;
+	int arg;
 	char *password = NULL;
 	const char *infile;
 	const char *outfile;
@@ -35,12 +51,51 @@ int main(int argc, char *argv[])
 	int hflag = 0;
 	int vflag = 0;
 	int sflag = 0;
+	int bflag = 0;
+	int jflag = 0;
+	int rflag = 0;
 	int errflag = 0;
+	int mflag = 0;
+	int ivflag = 0;
+	int cflag = 0;
+	int Bflag = 0;
+	int iflag = 0;
+	int Sflag = 0;
+	int nflag = 0;
+	int zflag = 0;
+	int batch = 0;
+	int archive = 0;
+	int verify = 0;
+	const char *member = NULL;
+	struct encdec_opts opts;
+
+	/* Long only options get values outside the range of option characters */
+	enum { OPT_RANGE = 256, OPT_IV, OPT_URING, OPT_MMAP, OPT_DIRECT, OPT_BATCH, OPT_ARCHIVE,
+		OPT_MEMBER, OPT_NO_HEADER, OPT_MAC, OPT_VERIFY };
+	static const struct option long_opts[] =
+	{
+		{ "range", required_argument, NULL, OPT_RANGE },
+		{ "iv", required_argument, NULL, OPT_IV },
+		{ "uring", no_argument, NULL, OPT_URING },
+		{ "mmap", no_argument, NULL, OPT_MMAP },
+		{ "direct", optional_argument, NULL, OPT_DIRECT },
+		{ "batch", no_argument, NULL, OPT_BATCH },
+		{ "archive", no_argument, NULL, OPT_ARCHIVE },
+		{ "member", required_argument, NULL, OPT_MEMBER },
+		{ "no-header", no_argument, NULL, OPT_NO_HEADER },
+		{ "mac", no_argument, NULL, OPT_MAC },
+		{ "verify", no_argument, NULL, OPT_VERIFY },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	memset(&opts, 0, sizeof(opts));
+	opts.mode = MODE_CFB64;
+	opts.jobs = 1;
 
 	/* Parses arguments and sets flags accordingly
 	 * If errflag is triggered then break the loop
 	 */
-	while (!errflag && ((arg = getopt(argc, argv, "devhsip:")) != -1))
+	while (!errflag && ((arg = getopt_long(argc, argv, "devhsbizB:S:c:j:m:p:", long_opts, NULL)) != -1))
 	{
 		switch(arg)
 		{
@@ -103,6 +158,246 @@ int main(int argc, char *argv[])
 				++sflag;
 				break;
 
+			case 'b':
+				if (bflag)
+				{
+					++errflag;
+					break;
+				}
+				++bflag;
+				break;
+
+			case 'i':
+				if (iflag)
+				{
+					++errflag;
+					break;
+				}
+				++iflag;
+				break;
+
+			case 'z':
+				if (zflag)
+				{
+					++errflag;
+					break;
+				}
+				++zflag;
+				opts.compress = 1;
+				break;
+
+			case 'j':
+				if (jflag)
+				{
+					++errflag;
+					break;
+				}
+				++jflag;
+				/* number of worker threads, must be a positive integer */
+				{
+					char *end;
+					long val = strtol(optarg, &end, 10);
+					if (*optarg == '\0' || *end != '\0' || val < 1 || val > 1024)
+					{
+						++errflag;
+						break;
+					}
+					opts.jobs = (int) val;
+				}
+				break;
+
+			case 'c':
+				if (cflag || Sflag)
+				{
+					++errflag;
+					break;
+				}
+				++cflag;
+				/* chunk size in MB, a power of two */
+				{
+					char *end;
+					long val = strtol(optarg, &end, 10);
+					if (*optarg == '\0' || *end != '\0' || val < 1 ||
+						val > 1L << (CHUNK_SHIFT_MAX - 20) || (val & (val - 1)) != 0)
+					{
+						++errflag;
+						break;
+					}
+					for (opts.chunk_shift = 20; val > 1; val >>= 1)
+					{
+						opts.chunk_shift++;
+					}
+				}
+				break;
+
+			case 'S':
+				if (Sflag || cflag)
+				{
+					++errflag;
+					break;
+				}
+				++Sflag;
+				/* sector size in bytes, a power of two */
+				{
+					size_t val;
+					if (parse_size(optarg, &val) < 0 || val < (size_t) 1 << SECTOR_SHIFT_MIN ||
+						val > (size_t) 1 << SECTOR_SHIFT_MAX || (val & (val - 1)) != 0)
+					{
+						++errflag;
+						break;
+					}
+					for (opts.chunk_shift = 0; val > 1; val >>= 1)
+					{
+						opts.chunk_shift++;
+					}
+					opts.sectors = 1;
+				}
+				break;
+
+			case 'B':
+				/* block size for reading and writing, whole pages */
+				if (Bflag || parse_size(optarg, &opts.block_size) < 0 ||
+					opts.block_size < IO_BLOCK_MIN || opts.block_size > IO_BLOCK_MAX ||
+					opts.block_size % IO_BLOCK_MIN != 0)
+				{
+					++errflag;
+					break;
+				}
+				++Bflag;
+				break;
+
+			case 'm':
+				if (mflag)
+				{
+					++errflag;
+					break;
+				}
+				++mflag;
+				if (strcmp(optarg, "cfb") == 0)
+				{
+					opts.mode = MODE_CFB64;
+				}
+				else if (strcmp(optarg, "ctr") == 0)
+				{
+					opts.mode = MODE_CTR64;
+				}
+				else if (strcmp(optarg, "ofb") == 0)
+				{
+					opts.mode = MODE_OFB64;
+				}
+				else if (strcmp(optarg, "cbc") == 0)
+				{
+					opts.mode = MODE_CBC;
+				}
+				else
+				{
+					++errflag;
+				}
+				break;
+
+			case OPT_RANGE:
+				if (rflag || parse_range(optarg, &opts.range_offset, &opts.range_length) < 0)
+				{
+					++errflag;
+					break;
+				}
+				++rflag;
+				opts.range = 1;
+				break;
+
+			case OPT_URING:
+				if (opts.mmap || opts.direct)
+				{
+					++errflag;
+					break;
+				}
+				opts.uring = 1;
+				break;
+
+			case OPT_MMAP:
+				if (opts.uring || opts.direct)
+				{
+					++errflag;
+					break;
+				}
+				opts.mmap = 1;
+				break;
+
+			case OPT_DIRECT:
+				/* --direct=nt also keeps the output out of the cache */
+				if (opts.uring || opts.mmap || opts.direct ||
+					(optarg != NULL && strcmp(optarg, "nt") != 0))
+				{
+					++errflag;
+					break;
+				}
+				opts.direct = 1;
+				opts.nontemporal = optarg != NULL;
+				break;
+
+			case OPT_BATCH:
+				if (batch)
+				{
+					++errflag;
+					break;
+				}
+				batch = 1;
+				break;
+
+			case OPT_ARCHIVE:
+				if (archive)
+				{
+					++errflag;
+					break;
+				}
+				archive = 1;
+				break;
+
+			case OPT_MEMBER:
+				if (member != NULL)
+				{
+					++errflag;
+					break;
+				}
+				member = optarg;
+				break;
+
+			case OPT_NO_HEADER:
+				if (nflag)
+				{
+					++errflag;
+					break;
+				}
+				++nflag;
+				break;
+
+			case OPT_MAC:
+				if (opts.mac)
+				{
+					++errflag;
+					break;
+				}
+				opts.mac = 1;
+				break;
+
+			case OPT_VERIFY:
+				if (verify)
+				{
+					++errflag;
+					break;
+				}
+				verify = 1;
+				break;
+
+			case OPT_IV:
+				if (ivflag || parse_iv(optarg, opts.iv) < 0)
+				{
+					++errflag;
+					break;
+				}
+				++ivflag;
+				break;
+
 			case '?':
 				++errflag;
 				break;
@@ -127,29 +422,166 @@ int main(int argc, char *argv[])
 		exit(EX_USAGE);
 	}
 
+	if (bflag)
+	{
+		select_kernel();
+	}
+
 	if (vflag)
 	{
-		fprintf(stderr, "v1.0\n");
+		fprintf(stderr, "v1.0 %s\n", BF_options());
 	}
 
 	/* If neither -d or -e was specified print error and exit */
-	if (!dflag && !eflag)
+	if (!dflag && !eflag && !verify)
 	{
 		fprintf(stderr, "Error: Must specify -d or -e\n");
 		print_usage();
 		exit(EX_USAGE);
 	}
 
-	/* If both file names are not specified, print error and exit */
-	if (argc != optind + 2)
+	/* Verifying only reads the file, its header says everything else */
+	if (verify && (dflag || eflag || iflag || batch || archive || rflag || cflag || Sflag || nflag ||
+		mflag || ivflag || opts.mac || zflag || opts.uring || opts.mmap || opts.direct))
+	{
+		fprintf(stderr, "Error: --verify cannot be used with -d, -e, -i, -m, --iv, -c, -S, --no-header, "
+			"--mac, -z, --batch, --archive, --range or the I/O options\n");
+		print_usage();
+		exit(EX_USAGE);
+	}
+
+	/* The tags go with chunks (1 MB unless -c says otherwise), which are
+	 * written and read by mac.c */
+	if (opts.mac && (!eflag || opts.mode == MODE_CBC || Sflag || nflag || iflag || batch || archive ||
+		opts.uring || opts.mmap || opts.direct))
+	{
+		fprintf(stderr, "Error: --mac can only be used with -e, not in cbc mode, "
+			"or with -S, --no-header, -i, --batch, --archive or the I/O options\n");
+		print_usage();
+		exit(EX_USAGE);
+	}
+
+	/* Compression too goes chunk by chunk, in compress.c */
+	if (zflag && (!eflag || opts.mode == MODE_CBC || Sflag || nflag || iflag || batch || archive ||
+		opts.mac || opts.uring || opts.mmap || opts.direct))
+	{
+		fprintf(stderr, "Error: -z can only be used with -e, not in cbc mode, "
+			"or with -S, --no-header, -i, --batch, --archive, --mac or the I/O options\n");
+		print_usage();
+		exit(EX_USAGE);
+	}
+	if ((opts.mac || zflag) && !cflag)
+	{
+		opts.chunk_shift = CHUNK_SHIFT_MIN;
+	}
+
+	/* Only decryption, CTR and chunked encryption can be split across threads,
+	 * in a batch it is files that are */
+	if (jflag && eflag && opts.mode != MODE_CTR64 && !cflag && !Sflag && !opts.mac && !zflag && !batch)
+	{
+		fprintf(stderr, "Error: -j can only encrypt in ctr mode or with -c, -S, --mac or -z\n");
+		print_usage();
+		exit(EX_USAGE);
+	}
+
+	/* CBC pads the end of the data, it can't be chunked */
+	if (cflag && (!eflag || opts.mode == MODE_CBC))
+	{
+		fprintf(stderr, "Error: -c can only be used with -e and not in cbc mode\n");
+		print_usage();
+		exit(EX_USAGE);
+	}
+
+	/* Sectors pad nothing and have to come out the size they went in, and
+	 * a disk has too many of them for OFB, see chunk_iv */
+	if (Sflag && (opts.mode == MODE_CBC || opts.mode == MODE_OFB64))
+	{
+		fprintf(stderr, "Error: -S cannot be used in cbc or ofb mode\n");
+		print_usage();
+		exit(EX_USAGE);
+	}
+
+	/* Without a header there is nowhere to record the chunk size */
+	if (nflag && cflag)
+	{
+		fprintf(stderr, "Error: --no-header cannot be used with -c\n");
+		print_usage();
+		exit(EX_USAGE);
+	}
+
+	/* Decryption goes by what the file says, unless -m says it is headerless
+	 * data in that mode, e.g. from another tool. Sectors never have a
+	 * header, either way, and --no-header leaves it off as cipher did
+	 * before it had one. */
+	if ((mflag && dflag) || Sflag || nflag)
+	{
+		opts.headerless = 1;
+	}
+	if (ivflag && !opts.headerless)
+	{
+		fprintf(stderr, "Error: --iv can only be used with -d and -m, -S or --no-header\n");
+		print_usage();
+		exit(EX_USAGE);
+	}
+
+	/* Ranges can only be taken out of encrypted files */
+	if (rflag && (!dflag || jflag))
+	{
+		fprintf(stderr, "Error: --range can only be used with -d and without -j\n");
+		print_usage();
+		exit(EX_USAGE);
+	}
+
+	/* In place the data has to stay the same length, so no header or padding,
+	 * and it is done a window at a time from front to back */
+	if (iflag && (jflag || rflag || cflag || opts.uring || opts.mmap || opts.direct ||
+		(eflag && opts.mode != MODE_CFB64 && !Sflag && !nflag) || opts.mode == MODE_CBC))
+	{
+		fprintf(stderr, "Error: -i can only encrypt in cfb mode or with -S or --no-header, or decrypt headerless data, "
+			"and not with -j, -c, --range or the I/O options\n");
+		print_usage();
+		exit(EX_USAGE);
+	}
+
+	/* A batch takes its files from stdin and does each of them serially */
+	if (batch && (iflag || rflag || opts.uring || opts.mmap || opts.direct))
+	{
+		fprintf(stderr, "Error: --batch cannot be used with -i, --range or the I/O options\n");
+		print_usage();
+		exit(EX_USAGE);
+	}
+	/* An archive is always CTR, written front to back and read by offset */
+	if (archive && (iflag || batch || rflag || cflag || Sflag || nflag || mflag || ivflag || jflag ||
+		opts.uring || opts.mmap || opts.direct))
+	{
+		fprintf(stderr, "Error: --archive cannot be used with -m, --iv, -c, -S, --no-header, -j, -i, --batch, "
+			"--range or the I/O options\n");
+		print_usage();
+		exit(EX_USAGE);
+	}
+	if (member != NULL && (!archive || !dflag))
+	{
+		fprintf(stderr, "Error: --member can only be used with --archive -d\n");
+		print_usage();
+		exit(EX_USAGE);
+	}
+
+	if ((batch || verify) && !jflag)
+	{
+		opts.jobs = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? (int) sysconf(_SC_NPROCESSORS_ONLN) : 1;
+	}
+
+	/* If both file names (or with -i or --verify the one, with --batch none)
+	 * are not specified, print error and exit */
+	if (argc != optind + (batch ? 0 : iflag || verify ? 1 : 2))
 	{
 		fprintf(stderr, "Error: Invalid number of file names\n");
 		print_usage();
 		exit(EX_USAGE);
 	}
 
-	infile = argv[optind];
-	outfile = argv[optind + 1];
+	infile = batch ? "-" : argv[optind];
+	outfile = batch ? "-" : argv[iflag || verify ? optind : optind + 1];
 
 	/* If a password wasn't supplied as an argument, get it now */
 	if (!pflag)
@@ -194,23 +626,252 @@ int main(int argc, char *argv[])
 				free(pw_buffer2);
 				exit(EX_USAGE);
 			}
-			free(pw_buffer2);
+			free(pw_buffer2);
+		}
+		password = pw_buffer1;
+	}
+
+	/* A range has to be read from a seekable file */
+	if (rflag && strcmp(infile, "-") == 0)
+	{
+		fprintf(stderr, "Error: --range cannot read from stdin\n");
+		exit(EX_USAGE);
+	}
+
+	if (batch)
+	{
+		batch_files(password, eflag, &opts);
+	}
+	else if (archive)
+	{
+		archive_file(infile, outfile, password, eflag, &opts, member);
+	}
+	else if (iflag)
+	{
+		inplace_file(infile, password, eflag, &opts);
+	}
+	else if (verify)
+	{
+		verify_file(infile, password, &opts);
+	}
+	else
+	{
+		encdec_file(infile, outfile, password, eflag, &opts);
+	}
+	free(password);
+
+	exit(EXIT_SUCCESS);
+}
+
+/*
+ * Prints usage text for the program
+ */
+void print_usage(void)
+{
+	fprintf(stderr, "usage: cipher [-devhsb] [-m cfb|ctr|ofb|cbc] [--no-header] [--iv HEX] [-c MB|-S SECTOR] [--mac|-z] [-j JOBS] [-B SIZE] [--uring|--mmap|--direct[=nt]] [--range OFF:LEN] [-p PASSWD] infile outfile\n"
+		"       cipher -i [-devhsb] [-m cfb|ctr|ofb] [--no-header] [--iv HEX] [-S SECTOR] [-p PASSWD] file\n"
+		"       cipher --verify [-vhsb] [-j JOBS] [-p PASSWD] infile\n"
+		"       cipher --batch [-devhsb] [-m cfb|ctr|ofb|cbc] [--no-header] [--iv HEX] [-c MB|-S SECTOR] [-j JOBS] [-B SIZE] [-p PASSWD] < list\n"
+		"       cipher --archive -e [-vhsb] [-B SIZE] [-p PASSWD] dir archive\n"
+		"       cipher --archive -d [-vhb] [-B SIZE] [--member NAME] [-p PASSWD] archive dir|outfile\n");
+}
+
+/*
+ * Parses a --range argument of the form OFFSET:LENGTH in bytes
+ * Returns 0 on success, -1 if it is malformed
+ */
+int parse_range(const char *arg, off_t *offset, off_t *length)
+{
+	char *end;
+	unsigned long long off;
+	unsigned long long len;
+
+	errno = 0;
+	off = strtoull(arg, &end, 10);
+	if (end == arg || *end != ':' || *arg == '-' || errno != 0)
+	{
+		return -1;
+	}
+	arg = end + 1;
+	len = strtoull(arg, &end, 10);
+	if (end == arg || *end != '\0' || *arg == '-' || errno != 0)
+	{
+		return -1;
+	}
+	/* Both have to fit in an off_t */
+	if (off > (unsigned long long) INT64_MAX || len > (unsigned long long) INT64_MAX - off)
+	{
+		return -1;
+	}
+	*offset = (off_t) off;
+	*length = (off_t) len;
+	return 0;
+}
+
+/*
+ * Parses an --iv argument of 16 hex digits into the 8 bytes at iv
+ * Returns 0 on success, -1 if it is malformed
+ */
+int parse_iv(const char *arg, unsigned char *iv)
+{
+	unsigned int byte;
+	int i;
+
+	if (strlen(arg) != 16 || strspn(arg, "0123456789abcdefABCDEF") != 16)
+	{
+		return -1;
+	}
+	for (i = 0; i < 8; i++)
+	{
+		sscanf(arg + 2 * i, "%2x", &byte);
+		iv[i] = (unsigned char) byte;
+	}
+	return 0;
+}
+
+/*
+ * Parses a size in bytes with an optional K, M or G suffix (powers of 1024)
+ * Returns 0 on success, -1 if it is malformed
+ */
+int parse_size(const char *arg, size_t *size)
+{
+	char *end;
+	unsigned long long val;
+	int shift = 0;
+
+	errno = 0;
+	val = strtoull(arg, &end, 10);
+	if (end == arg || *arg == '-' || errno != 0)
+	{
+		return -1;
+	}
+	switch (*end)
+	{
+		case 'K': case 'k':
+			shift = 10;
+			break;
+
+		case 'M': case 'm':
+			shift = 20;
+			break;
+
+		case 'G': case 'g':
+			shift = 30;
+			break;
+
+		case '\0':
+			break;
+
+		default:
+			return -1;
+	}
+	if (shift != 0 && end[1] != '\0')
+	{
+		return -1;
+	}
+	if (val > (unsigned long long) SIZE_MAX >> shift)
+	{
+		return -1;
+	}
+	*size = (size_t) val << shift;
+	return 0;
+}
+
+/*
+ * Gets the CPU model name from /proc/cpuinfo
+ * Returns 0 on success, -1 if it isn't known
+ */
+int get_cpu_model(char *model, size_t size)
+{
+	FILE *fp;
+	char line[256];
+	int ret = -1;
+
+	if ((fp = fopen("/proc/cpuinfo", "r")) == NULL)
+	{
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		char *value = strchr(line, ':');
+		if (strncmp(line, "model name", 10) == 0 && value != NULL)
+		{
+			/* skip the ": " and drop the newline */
+			value += strspn(value, ": \t");
+			value[strcspn(value, "\n")] = '\0';
+			snprintf(model, size, "%s", value);
+			ret = 0;
+			break;
+		}
+	}
+	fclose(fp);
+	return ret;
+}
+
+/*
+ * Picks the Blowfish kernels for this CPU by benchmarking them
+ * The winner is remembered per CPU model in $XDG_CACHE_HOME/cipher_kernels
+ * (or ~/.cache/cipher_kernels) so later runs on the same model skip it
+ */
+void select_kernel(void)
+{
+	char model[256];
+	char cache_dir[PATH_MAX];
+	char path[PATH_MAX + 32];
+	char line[512];
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	const char *spec;
+	FILE *fp;
+
+	/* Without a model name or a place to cache the result just benchmark */
+	if (get_cpu_model(model, sizeof(model)) < 0 ||
+		((xdg == NULL || *xdg == '\0') && home == NULL))
+	{
+		BF_bench_kernel();
+		return;
+	}
+
+	if (xdg != NULL && *xdg != '\0')
+	{
+		snprintf(cache_dir, sizeof(cache_dir), "%s", xdg);
+	}
+	else
+	{
+		snprintf(cache_dir, sizeof(cache_dir), "%s/.cache", home);
+	}
+	snprintf(path, sizeof(path), "%s/cipher_kernels", cache_dir);
+
+	/* Lines in the cache are "model\tkernels" */
+	if ((fp = fopen(path, "r")) != NULL)
+	{
+		while (fgets(line, sizeof(line), fp) != NULL)
+		{
+			char *tab = strchr(line, '\t');
+			if (tab == NULL)
+			{
+				continue;
+			}
+			*tab = '\0';
+			tab[1 + strcspn(tab + 1, "\n")] = '\0';
+			if (strcmp(line, model) == 0 && BF_set_kernel(tab + 1) == 0)
+			{
+				fclose(fp);
+				return;
+			}
 		}
-		password = pw_buffer1;
+		fclose(fp);
 	}
 
-	encdec_file(infile, outfile, password, eflag);
-	free(password);
-
-	exit(EXIT_SUCCESS);
-}
+	spec = BF_bench_kernel();
 
-/*
- * Prints usage text for the program
- */
-void print_usage(void)
-{
-	fprintf(stderr, "usage: cipher [-devhs] [-p PASSWD] infile outfile\n");
+	/* Failing to write the cache only costs another benchmark next time */
+	mkdir(cache_dir, S_IRWXU);
+	if ((fp = fopen(path, "a")) != NULL)
+	{
+		fprintf(fp, "%s\t%s\n", model, spec);
+		fclose(fp);
+	}
 }
 
 /*
@@ -218,11 +879,15 @@ void print_usage(void)
  * Exits the program if possible errors are detected
  * infile - name for the input file, "-" for stdin
  * outfile - name for the output file, "-" for stdout
+ * devices - if 1 either may be a block device
  */
-void check_files(const char *infile, const int infile_des, const char *outfile, const int outfile_des)
+void check_files(const char *infile, const int infile_des, const char *outfile, const int outfile_des,
+	int devices)
 {
 	struct stat infile_stat;
 	struct stat outfile_stat;
+	off_t infile_size = 0;
+	off_t outfile_size;
 
 	int istat = fstat(infile_des, &infile_stat);
 	int ostat = fstat(outfile_des, &outfile_stat);
@@ -241,7 +906,7 @@ void check_files(const char *infile, const int infile_des, const char *outfile,
 		}
 
 		/* File is a directory so exit */
-		if (!S_ISREG(infile_stat.st_mode))
+		if (!S_ISREG(infile_stat.st_mode) && !(devices && S_ISBLK(infile_stat.st_mode)))
 		{
 			if (S_ISDIR(infile_stat.st_mode))
 			{
@@ -282,7 +947,7 @@ void check_files(const char *infile, const int infile_des, const char *outfile,
 		}
 
 		/* File is a directory so exit */
-		if (!S_ISREG(outfile_stat.st_mode))
+		if (!S_ISREG(outfile_stat.st_mode) && !(devices && S_ISBLK(outfile_stat.st_mode)))
 		{
 			if (S_ISDIR(outfile_stat.st_mode))
 			{
@@ -301,19 +966,46 @@ void check_files(const char *infile, const int infile_des, const char *outfile,
 		}
 	}
 
-	/* Check if both filepaths actually point to the same file.
+	/* Check if both filepaths actually point to the same file, or device.
 	 * If they do then exit */
 	if ((strcmp(infile, "-") != 0 && strcmp(outfile, "-") != 0) && 
-		(infile_stat.st_dev == outfile_stat.st_dev) && 
-		(infile_stat.st_ino == outfile_stat.st_ino))
+		(((infile_stat.st_dev == outfile_stat.st_dev) && 
+		(infile_stat.st_ino == outfile_stat.st_ino)) ||
+		(S_ISBLK(infile_stat.st_mode) && S_ISBLK(outfile_stat.st_mode) &&
+		infile_stat.st_rdev == outfile_stat.st_rdev)))
 	{
 		fprintf(stderr, "Error: %s and %s are the same file\n", infile, outfile);
 		close_file(infile, infile_des);
 		close_file(outfile, outfile_des);
 		exit(EX_USAGE);
 	}
+	if (strcmp(infile, "-") != 0 && file_size(infile_des, &infile_size) < 0)
+	{
+		perror(infile);
+		close_file(infile, infile_des);
+		close_file(outfile, outfile_des);
+		exit(EX_NOINPUT);
+	}
+	/* A device has to be big enough to take all of infile */
+	if (strcmp(infile, "-") != 0 && strcmp(outfile, "-") != 0 && S_ISBLK(outfile_stat.st_mode))
+	{
+		if (file_size(outfile_des, &outfile_size) < 0)
+		{
+			perror(outfile);
+			close_file(infile, infile_des);
+			close_file(outfile, outfile_des);
+			exit(EX_NOINPUT);
+		}
+		if (outfile_size < infile_size)
+		{
+			fprintf(stderr, "%s is smaller than %s\n", outfile, infile);
+			close_file(infile, infile_des);
+			close_file(outfile, outfile_des);
+			exit(EX_CANTCREAT);
+		}
+	}
 	/* check if file system has enough space */
-	if (strcmp(infile, "-") != 0 && strcmp(outfile, "-") != 0)
+	else if (strcmp(infile, "-") != 0 && strcmp(outfile, "-") != 0)
 	{
 		struct statvfs fsinfo;
 		if (fstatvfs(outfile_des, &fsinfo) < 0)
@@ -323,8 +1015,13 @@ void check_files(const char *infile, const int infile_des, const char *outfile,
 			close_file(outfile, outfile_des);
 			exit(EX_NOINPUT);
 		}
-		long free_space = fsinfo.f_bsize * fsinfo.f_bfree;
-		if (free_space < infile_stat.st_size)
+		/* What is in outfile now is about to go, and with it the blocks it uses */
+		unsigned long long free_space = (unsigned long long) fsinfo.f_frsize * fsinfo.f_bavail;
+		if (ostat == 0)
+		{
+			free_space += (unsigned long long) outfile_stat.st_blocks * 512;
+		}
+		if (free_space < (unsigned long long) infile_size)
 		{
 			fprintf(stderr, "Not enough free space on file system\n");
 			close_file(infile, infile_des);
@@ -336,10 +1033,15 @@ void check_files(const char *infile, const int infile_des, const char *outfile,
 
 /*
  * Opens both infile and outfile and returns the file descriptors
+ * out_access is O_WRONLY, or O_RDWR if outfile is going to be mapped or
+ * written with direct I/O
+ * *created is set to 1 if outfile didn't exist and was created, else 0
  * Will exit if it fails to open a file
  */
-void open_files(const char *infile, const char *outfile, int *infile_des, int *outfile_des)
+void open_files(const char *infile, const char *outfile, int *infile_des, int *outfile_des,
+	int out_access, int *created)
 {
+	*created = 0;
 	/* if infile == "-" then use stdin */
 	if (strcmp(infile, "-") == 0)
 	{
@@ -357,8 +1059,12 @@ void open_files(const char *infile, const char *outfile, int *infile_des, int *o
 	{
 		*outfile_des = fileno(stdout);
 	}
-	/* Try to open the file, if it fails exit */
-	else if ((*outfile_des = open(outfile, O_WRONLY | O_CREAT, S_IRWXU)) < 0)
+	/* Try to create the file, or else open the one there is, if it fails exit */
+	else if ((*outfile_des = open(outfile, out_access | O_CREAT | O_EXCL, S_IRWXU)) >= 0)
+	{
+		*created = 1;
+	}
+	else if (errno != EEXIST || (*outfile_des = open(outfile, out_access | O_CREAT, S_IRWXU)) < 0)
 	{
 		perror(outfile);
 		close_file(infile, *infile_des);
@@ -372,110 +1078,537 @@ void open_files(const char *infile, const char *outfile, int *infile_des, int *o
  * outfile - nmae of the outfile
  * password - the password to use for encrypting/decrypting
  * enc_flag - if 1 encrypt, else decrypt
+ * opts - mode to encrypt with, threads to use, block size, range to decrypt
  */
-void encdec_file(const char *infile, const char *outfile, char *password, const int enc_flag)
+void encdec_file(const char *infile, const char *outfile, char *password, const int enc_flag,
+	const struct encdec_opts *opts)
 {
 	/* define a structure to hold the key */
 	BF_KEY key;
 
-	/* don't worry about these two: just define/use them */
-	int n = 0;			/* internal blowfish variables */
-	unsigned char iv[8];		/* Initialization Vector */
-
-	/* fill the IV with zeros (or any other fixed data) */
-	memset(iv, 0, 8);
+	struct crypt_ctx ctx;
+	struct stream st;
+	struct keystream ks;
+	struct stat infile_stat;
+	struct stat outfile_stat;
+	int direct;
+	int ret;
+	unsigned char header_buf[HEADER_SIZE];
+	/* bytes of data already read while looking for a header */
+	ssize_t buffered = 0;
 
 	/* call this function once to setup the cipher key */
 	BF_set_key(&key, strlen(password), (unsigned char *) password);
 
 	int infile_des;
 	int outfile_des;
+	int created;
 	/* Try to open both files and check for errors */
-	open_files(infile, outfile, &infile_des, &outfile_des);
-	check_files(infile, infile_des, outfile, outfile_des);
+	open_files(infile, outfile, &infile_des, &outfile_des,
+		opts->mmap || opts->direct || opts->sectors ? O_RDWR : O_WRONLY, &created);
+	check_files(infile, infile_des, outfile, outfile_des, opts->sectors);
 
+	/* Devices are read and written with direct I/O unless told otherwise,
+	 * their page cache is of no use to anyone afterwards */
+	direct = opts->direct || (!opts->uring && !opts->mmap &&
+		((fstat(infile_des, &infile_stat) == 0 && S_ISBLK(infile_stat.st_mode)) ||
+		(fstat(outfile_des, &outfile_stat) == 0 && S_ISBLK(outfile_stat.st_mode))));
 
-	/* Get the page size */
-	const int page_size = getpagesize();
+	/* Headerless CFB-64 with a zero IV unless the header says otherwise */
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.infile = infile;
+	ctx.outfile = outfile;
+	ctx.infile_des = infile_des;
+	ctx.outfile_des = outfile_des;
+	ctx.key = &key;
+	ctx.enc = enc_flag;
+	ctx.mode = MODE_CFB64;
+	/* Unless told otherwise go by what the files and their devices prefer */
+	ctx.block_size = opts->block_size != 0 ? opts->block_size : io_block_size(infile_des, outfile_des);
 
-	/* Try to allocate memory for the input buffer */
-	unsigned char *input_buffer;
-	if ((input_buffer = (unsigned char *) malloc(sizeof(unsigned char) * page_size)) == NULL)
+	/* Read the header, if any, and check the password before an existing
+	 * outfile is touched, a wrong one mustn't cost what was in it. Only an
+	 * outfile made by this run is removed. */
+	if (!enc_flag && header_setup(&ctx, opts, header_buf, &buffered) < 0)
 	{
-		/* malloc failed so exit */
-		fprintf(stderr, "%s\n", strerror(errno));
 		close_file(infile, infile_des);
 		close_file(outfile, outfile_des);
-		unlink(outfile);
+		if (created)
+		{
+			unlink(outfile);
+		}
 		exit(EXIT_FAILURE);
 	}
-	
-	/* Try to allocate memory for the output buffer */
-	unsigned char *output_buffer;
-	if ((output_buffer = (unsigned char *) malloc(sizeof(unsigned char) * page_size)) == NULL)
+
+	/* Only now that it is known not to be infile, empty an existing outfile;
+	 * opening it with O_TRUNC would have emptied infile too if it was.
+	 * A device stays the size it is, only the data is written over. */
+	if (strcmp(outfile, "-") != 0 && fstat(outfile_des, &outfile_stat) == 0 &&
+		S_ISREG(outfile_stat.st_mode) && ftruncate(outfile_des, 0) < 0)
 	{
-		/* malloc failed so free input buffer, close files and exit */
-		fprintf(stderr, "%s\n", strerror(errno));
-		free(input_buffer);
+		perror(outfile);
+		abort_encdec(infile, infile_des, outfile, outfile_des);
+	}
+
+	/* Write the header, if any */
+	if (enc_flag && header_setup(&ctx, opts, header_buf, &buffered) < 0)
+	{
+		abort_encdec(infile, infile_des, outfile, outfile_des);
+	}
+
+	/* Reserve the output and get the input coming, a range reads little */
+	if (!opts->range && prepare_files(&ctx, direct) < 0)
+	{
+		abort_encdec(infile, infile_des, outfile, outfile_des);
+	}
+
+	/* Files with MACs have a tag after every chunk and compressed files
+	 * chunks of any length, so the data isn't where the other paths look
+	 * for it; mac.c checks each chunk before it writes any of it, and
+	 * compress.c finds a range through its index */
+	if (ctx.mac || ctx.compress)
+	{
+		if (ctx.mac && opts->range)
+		{
+			fprintf(stderr, "Error: --range cannot be used on a file with MACs\n");
+			abort_encdec(infile, infile_des, outfile, outfile_des);
+		}
+		if (ctx.mac)
+		{
+			ret = crypt_mac(&ctx, opts->jobs, 0);
+		}
+		else if (opts->range)
+		{
+			ret = compressed_range(&ctx, opts->range_offset, opts->range_length);
+		}
+		else
+		{
+			ret = crypt_compressed(&ctx, opts->jobs);
+		}
+		memset(&key, 0, sizeof(key));
+		if (ret < 0)
+		{
+			abort_encdec(infile, infile_des, outfile, outfile_des);
+		}
 		close_file(infile, infile_des);
 		close_file(outfile, outfile_des);
-		unlink(outfile);
-		exit(EXIT_FAILURE);
+		return;
+	}
+
+	/* check_files made sure anything that isn't stdin/stdout is a regular file,
+	 * or with -S a device.
+	 * Chunks can always be split up, otherwise only CTR and decryption can,
+	 * and not OFB as its keystream is serial. */
+	if (opts->range || (opts->jobs > 1 && (ctx.chunk_shift != 0 ||
+		(ctx.mode != MODE_OFB64 && (!enc_flag || ctx.mode == MODE_CTR64))) &&
+		strcmp(infile, "-") != 0 && strcmp(outfile, "-") != 0))
+	{
+		if (opts->range)
+		{
+			ret = decrypt_range(&ctx, opts->range_offset, opts->range_length);
+		}
+		else
+		{
+			ret = crypt_parallel(&ctx, opts->jobs);
+			if (ret == 0 && ctx.mode == MODE_CBC)
+			{
+				ret = cbc_truncate(&ctx);
+			}
+		}
+		memset(&key, 0, sizeof(key));
+		if (ret < 0)
+		{
+			abort_encdec(infile, infile_des, outfile, outfile_des);
+		}
+		close_file(infile, infile_des);
+		close_file(outfile, outfile_des);
+		return;
 	}
 
-	/* Set behavior to encrypt or decrypt */
-	int enc_or_dec;
-	if (enc_flag == 1)
+	/* CBC needs whole blocks and padding, which the pipeline below doesn't give it */
+	if (ctx.mode == MODE_CBC)
 	{
-		enc_or_dec = BF_ENCRYPT;
+		ret = cbc_crypt_serial(&ctx);
+		memset(&key, 0, sizeof(key));
+		if (ret < 0)
+		{
+			abort_encdec(infile, infile_des, outfile, outfile_des);
+		}
+		close_file(infile, infile_des);
+		close_file(outfile, outfile_des);
+		return;
 	}
-	else
+
+	stream_init(&st, &ctx);
+
+	/* The OFB keystream doesn't depend on the data, so have another thread
+	 * make it while this one waits on I/O. Without one OFB still works.
+	 * It makes the keystream a slot at a time, which sectors are smaller than. */
+	if (ctx.mode == MODE_OFB64 && (ctx.chunk_shift == 0 || (1 << ctx.chunk_shift) >= KS_SLOT_SIZE) &&
+		ks_start(&ks, &ctx) == 0)
 	{
-		enc_or_dec = BF_DECRYPT;
+		st.ks = &ks;
 	}
 
-	int bytes_read;
-	int bytes_written;
-	/* Read/write loop. If an error occurs program will halt and exit */
-	while ((bytes_read = read(infile_des, input_buffer, page_size)) > 0)
+	/* Whatever was read looking for a header is the start of the data */
+	if (buffered > 0)
 	{
-		BF_cfb64_encrypt(input_buffer, output_buffer, bytes_read, &key, iv, &n, enc_or_dec);
-		/* If there is an error with writing, close and free everything and exit */
-		if ((bytes_written = write(outfile_des, output_buffer, bytes_read)) <= 0)
+		stream_crypt(&st, header_buf, header_buf, buffered);
+		if (write_full(outfile_des, header_buf, buffered) < 0)
 		{
 			perror(outfile);
-			free(input_buffer);
-			free(output_buffer);
-			close_file(infile, infile_des);
-			close_file(outfile, outfile_des);
-			unlink(outfile);
+			abort_encdec(infile, infile_des, outfile, outfile_des);
+		}
+	}
+
+	/* Reading, encrypting and writing the rest overlap, either through
+	 * io_uring or in three threads, or the files are mapped, or it is done
+	 * with direct I/O. io_uring and direct I/O only do regular files and
+	 * devices, mmap only regular files, and io_uring may not be there at
+	 * all, the pipeline does anything.
+	 * If an error occurs program will halt and exit */
+	ret = 1;
+	if (opts->mmap)
+	{
+		ret = crypt_mmap(&ctx, &st);
+	}
+	else if (opts->uring)
+	{
+		ret = crypt_uring(&ctx, &st);
+	}
+	else if (direct)
+	{
+		ret = crypt_direct(&ctx, &st, opts->nontemporal);
+	}
+	if (ret == 1)
+	{
+		ret = crypt_pipeline(&ctx, &st);
+	}
+	if (ret < 0)
+	{
+		abort_encdec(infile, infile_des, outfile, outfile_des);
+	}
+
+	/* Cleanup */
+	if (st.ks != NULL)
+	{
+		ks_stop(st.ks);
+	}
+	memset(&st, 0, sizeof(st));
+	memset(&key, 0, sizeof(key));
+	close_file(infile, infile_des);
+	close_file(outfile, outfile_des);
+}
+
+/*
+ * Encrypts or decrypts file in place depending on what enc_flag is set to
+ * That only works for headerless data: encryption in cfb mode, decryption
+ * of such a file, or of -m data with --iv, or, with -S or --no-header, in
+ * any mode but cbc
+ * On failure exits, leaving the journal in file.journal for a rerun with
+ * the same options to resume from
+ * file - name of the file
+ * password - the password to use for encrypting/decrypting
+ * enc_flag - if 1 encrypt, else decrypt
+ * opts - the mode, IV and sector size of headerless data
+ */
+void inplace_file(const char *file, char *password, const int enc_flag,
+	const struct encdec_opts *opts)
+{
+	BF_KEY key;
+	struct crypt_ctx ctx;
+	struct file_header hdr;
+	struct stat file_stat;
+	unsigned char header_buf[HEADER_SIZE];
+	char *journal;
+	ssize_t got;
+	int file_des;
+	int ret;
+
+	if (strcmp(file, "-") == 0)
+	{
+		fprintf(stderr, "Error: -i needs a file, not stdin\n");
+		exit(EX_USAGE);
+	}
+	if ((file_des = open(file, O_RDWR)) < 0)
+	{
+		perror(file);
+		exit(EX_NOINPUT);
+	}
+	if (fstat(file_des, &file_stat) < 0)
+	{
+		perror(file);
+		close_file(file, file_des);
+		exit(EX_NOINPUT);
+	}
+	if (!S_ISREG(file_stat.st_mode))
+	{
+		fprintf(stderr, "%s is not a regular file\n", file);
+		close_file(file, file_des);
+		exit(EX_USAGE);
+	}
+
+	/* Taking the header off would move all of the data */
+	if (!enc_flag && !opts->headerless)
+	{
+		if ((got = pread_full(file_des, header_buf, HEADER_SIZE, 0)) < 0)
+		{
+			perror(file);
+			close_file(file, file_des);
 			exit(EXIT_FAILURE);
 		}
+		if (header_decode(header_buf, got, &hdr) != 0)
+		{
+			fprintf(stderr, "%s has a header, it can't be decrypted in place\n", file);
+			close_file(file, file_des);
+			exit(EX_USAGE);
+		}
+	}
+
+	if ((journal = malloc(strlen(file) + sizeof(".journal"))) == NULL)
+	{
+		fprintf(stderr, "%s\n", strerror(errno));
+		close_file(file, file_des);
+		exit(EXIT_FAILURE);
+	}
+	sprintf(journal, "%s.journal", file);
+
+	BF_set_key(&key, strlen(password), (unsigned char *) password);
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.infile = file;
+	ctx.outfile = file;
+	ctx.infile_des = file_des;
+	ctx.outfile_des = file_des;
+	ctx.key = &key;
+	ctx.enc = enc_flag;
+	ctx.mode = MODE_CFB64;
+	if (opts->headerless)
+	{
+		ctx.mode = opts->mode;
+		ctx.chunk_shift = opts->chunk_shift;
+		memcpy(ctx.iv, opts->iv, sizeof(ctx.iv));
 	}
 
-	/* If there was an error in reading, close everything and exit */
-	if (bytes_read < 0)
+	ret = crypt_inplace(&ctx, journal);
+
+	memset(&key, 0, sizeof(key));
+	free(journal);
+	close_file(file, file_des);
+	if (ret < 0)
+	{
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Checks the tags of infile, a file encrypted with --mac, without
+ * decrypting it or writing anything
+ * Exits if it fails, at the first bad chunk
+ * infile - name of the file, - for stdin
+ * password - the password it was encrypted with
+ * opts - threads to use
+ */
+void verify_file(const char *infile, char *password, const struct encdec_opts *opts)
+{
+	BF_KEY key;
+	struct crypt_ctx ctx;
+	unsigned char header_buf[HEADER_SIZE];
+	ssize_t buffered;
+	int infile_des;
+	int ret;
+
+	if (strcmp(infile, "-") == 0)
+	{
+		infile_des = fileno(stdin);
+	}
+	else if ((infile_des = open(infile, O_RDONLY)) < 0)
 	{
 		perror(infile);
-		free(input_buffer);
-		free(output_buffer);
-		close_file(infile, infile_des);
-		close_file(outfile, outfile_des);
-		unlink(outfile);
+		exit(EX_NOINPUT);
+	}
+
+	BF_set_key(&key, strlen(password), (unsigned char *) password);
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.infile = infile;
+	ctx.infile_des = infile_des;
+	ctx.outfile_des = -1;
+	ctx.key = &key;
+	ctx.mode = MODE_CFB64;
+
+	/* The header has the key check, a wrong password goes no further */
+	ret = header_setup(&ctx, opts, header_buf, &buffered);
+	if (ret == 0 && !ctx.mac)
+	{
+		fprintf(stderr, "%s has no MACs to verify, it wasn't encrypted with --mac\n", infile);
+		ret = -1;
+	}
+	if (ret == 0)
+	{
+		ret = crypt_mac(&ctx, opts->jobs, 1);
+	}
+
+	memset(&key, 0, sizeof(key));
+	close_file(infile, infile_des);
+	if (ret < 0)
+	{
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Encrypts or decrypts the files listed on stdin depending on what
+ * enc_flag is set to, see crypt_batch
+ * Exits if any of them fail, once the rest are done
+ * password - the password to use for encrypting/decrypting
+ * enc_flag - if 1 encrypt, else decrypt
+ * opts - mode to encrypt with, threads to use, block size
+ */
+void batch_files(char *password, const int enc_flag, const struct encdec_opts *opts)
+{
+	BF_KEY key;
+	struct crypt_ctx ctx;
+	int ret;
+
+	/* The one key schedule for all of the files */
+	BF_set_key(&key, strlen(password), (unsigned char *) password);
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.key = &key;
+	ctx.enc = enc_flag;
+	ctx.mode = MODE_CFB64;
+	/* Files in a batch are mostly small, no point asking each one */
+	ctx.block_size = opts->block_size != 0 ? opts->block_size : IO_BLOCK_DEFAULT;
+
+	ret = crypt_batch(&ctx, opts, opts->jobs, stdin);
+
+	memset(&key, 0, sizeof(key));
+	if (ret < 0)
+	{
 		exit(EXIT_FAILURE);
 	}
+}
+
+/*
+ * Packs the directory tree infile into the archive outfile, or extracts
+ * the archive infile into the directory outfile, or with member only that
+ * file of it onto outfile, depending on what enc_flag is set to
+ * On failure exits, removing a partial archive or member
+ * password - the password to use for encrypting/decrypting
+ * enc_flag - if 1 encrypt, else decrypt
+ * opts - block size
+ * member - name of the one file to extract, relative to the top of the tree
+ */
+void archive_file(const char *infile, const char *outfile, char *password, const int enc_flag,
+	const struct encdec_opts *opts, const char *member)
+{
+	BF_KEY key;
+	struct crypt_ctx ctx;
+	struct stat file_stat;
+	int infile_des;
+	int outfile_des = -1;
+	int created = 0;
+	int emptied = 0;
+	int ret;
 
-	/* Print a newline to terminal if outputting to stdout */
-	if (outfile_des == STDOUT_FILENO)
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.infile = infile;
+	ctx.outfile = outfile;
+	ctx.key = &key;
+	ctx.enc = enc_flag;
+	ctx.mode = MODE_CTR64;
+	ctx.block_size = opts->block_size != 0 ? opts->block_size : IO_BLOCK_DEFAULT;
+
+	/* The tree and the archive, the archive and a member; extracting it
+	 * all only has the archive to open */
+	if (enc_flag || member != NULL)
+	{
+		open_files(infile, outfile, &infile_des, &outfile_des, O_WRONLY, &created);
+	}
+	else if ((infile_des = open(infile, O_RDONLY)) < 0)
 	{
-		fprintf(stdout, "\n");
+		perror(infile);
+		exit(EX_NOINPUT);
 	}
+	ctx.infile_des = infile_des;
+	ctx.outfile_des = outfile_des;
+
+	if (fstat(infile_des, &file_stat) < 0 ||
+		(enc_flag ? !S_ISDIR(file_stat.st_mode) : !S_ISREG(file_stat.st_mode)))
+	{
+		fprintf(stderr, enc_flag ? "%s is not a directory\n" : "%s is not a regular file\n", infile);
+		close_file(infile, infile_des);
+		if (outfile_des >= 0)
+		{
+			close_file(outfile, outfile_des);
+		}
+		exit(EX_USAGE);
+	}
+	/* A member's outfile is only emptied by archive_member, once the
+	 * password has been checked */
+	if (enc_flag && fstat(outfile_des, &file_stat) == 0 && S_ISREG(file_stat.st_mode) &&
+		ftruncate(outfile_des, 0) < 0)
+	{
+		perror(outfile);
+		abort_encdec(infile, infile_des, outfile, outfile_des);
+	}
+	if (enc_flag && random_bytes(ctx.iv, sizeof(ctx.iv)) < 0)
+	{
+		perror("/dev/urandom");
+		abort_encdec(infile, infile_des, outfile, outfile_des);
+	}
+
+	BF_set_key(&key, strlen(password), (unsigned char *) password);
+
+	if (enc_flag)
+	{
+		ret = archive_pack(&ctx);
+	}
+	else if (member != NULL)
+	{
+		ret = archive_member(&ctx, member, &emptied);
+	}
+	else
+	{
+		ret = archive_unpack(&ctx, outfile);
+	}
+
+	memset(&key, 0, sizeof(key));
+	/* An existing outfile is only removed once its contents are gone */
+	if (ret < 0 && outfile_des >= 0 && (enc_flag || created || emptied))
+	{
+		abort_encdec(infile, infile_des, outfile, outfile_des);
+	}
+	close_file(infile, infile_des);
+	if (outfile_des >= 0)
+	{
+		close_file(outfile, outfile_des);
+	}
+	if (ret < 0)
+	{
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Closes both files, removes the partial outfile and exits
+ * For errors in encdec_file once the files are open
+ */
+void abort_encdec(const char *infile, int infile_des, const char *outfile, int outfile_des)
+{
+	struct stat outfile_stat;
+	/* A device is left as it is, its node isn't ours to remove */
+	int partial = strcmp(outfile, "-") != 0 && fstat(outfile_des, &outfile_stat) == 0 &&
+		S_ISREG(outfile_stat.st_mode);
 
-	/* Cleanup */
-	free(output_buffer);
-	free(input_buffer);
 	close_file(infile, infile_des);
 	close_file(outfile, outfile_des);
+	if (partial)
+	{
+		unlink(outfile);
+	}
+	exit(EXIT_FAILURE);
 }
 
 /*
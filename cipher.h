@@ -0,0 +1,267 @@
+#ifndef CIPHER_H
+#define CIPHER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include "blowfish.h"
+
+/* Cipher modes, the values are what the file header records */
+#define MODE_CFB64 0
+#define MODE_CTR64 1
+#define MODE_OFB64 2
+#define MODE_CBC 3
+#define MODE_LAST MODE_CBC
+
+/*
+ * Encrypted files start with a header:
+ *   0  "BFCIPHER"
+ *   8  version
+ *   9  mode
+ *  10  chunk size as a power of two, 0 if not chunked
+ *  11  flags, HEADER_FLAG_MAC or HEADER_FLAG_COMPRESS
+ *  16  IV, or the initial counter for CTR
+ *  24  key check, see header_check
+ * A file without one is headerless CFB-64 with an all zero IV, which is
+ * what cipher wrote before it had headers, and still writes with
+ * --no-header. A header of any version but HEADER_VERSION is refused, so
+ * nothing can be had by rewriting one as an older, weaker one.
+ *
+ * A chunked file runs the cipher over each chunk of the data on its own,
+ * starting over with an IV derived from the header one (see chunk_iv), so
+ * chunks can be encrypted as well as decrypted in any order. With
+ * HEADER_FLAG_MAC every chunk is followed by a MAC_TAG_SIZE byte tag, see
+ * mac.c; with HEADER_FLAG_COMPRESS every chunk is compressed before it is
+ * encrypted, see compress.c.
+ */
+#define HEADER_MAGIC "BFCIPHER"
+#define ARCHIVE_MAGIC "BFARCHIV"	/* archives, see archive.c */
+#define HEADER_MAGIC_LEN 8
+#define HEADER_VERSION 3
+#define HEADER_SIZE 32
+#define CHUNK_SHIFT_MIN 20
+#define CHUNK_SHIFT_MAX 24
+#define HEADER_FLAG_MAC 1
+#define HEADER_FLAG_COMPRESS 2
+#define MAC_TAG_SIZE 16
+
+/*
+ * Data in sectors, for disks, has no header and is chunked into sectors
+ * of 1 << SECTOR_SHIFT_MIN to 1 << SECTOR_SHIFT_MAX bytes, so each can
+ * be encrypted and decrypted on its own, with the IV of sector n being
+ * chunk_iv of n.
+ */
+#define SECTOR_SHIFT_MIN 9
+#define SECTOR_SHIFT_MAX 16
+
+struct file_header
+{
+	int version;
+	int mode;
+	int chunk_shift;
+	int flags;
+	unsigned char iv[8];
+	unsigned char check[8];
+};
+
+/* Command line options that change how encdec_file goes about its work */
+struct encdec_opts
+{
+	int mode;		/* mode to encrypt with, decryption goes by the header */
+	int headerless;		/* the data is headerless, in mode with iv */
+	unsigned char iv[8];
+	int chunk_shift;	/* encrypt in chunks of 1 << chunk_shift bytes, 0 for one stream */
+	int sectors;		/* headerless, in sectors of 1 << chunk_shift bytes */
+	int mac;		/* encrypt with a tag for every chunk */
+	int compress;		/* compress every chunk before encrypting it */
+	int jobs;		/* worker threads, 1 for the serial path */
+	int uring;		/* try io_uring for the serial path */
+	int mmap;		/* try mmap for the serial path */
+	int direct;		/* try O_DIRECT for the serial path */
+	int nontemporal;	/* and write its output with non-temporal stores */
+	size_t block_size;	/* bytes per read and write, 0 to pick one for the files */
+	int range;		/* if set only decrypt the range below */
+	off_t range_offset;
+	off_t range_length;
+};
+
+/*
+ * Bounds of the block size, the unit the I/O paths read and write in
+ * It is a multiple of IO_BLOCK_MIN, the smallest page size
+ */
+#define IO_BLOCK_MIN 4096
+#define IO_BLOCK_DEFAULT (1024 * 1024)
+#define IO_BLOCK_MAX (256 * 1024 * 1024)
+
+/*
+ * Everything about one infile/outfile pair that the workers need
+ * in_base and out_base are where the data starts in each file,
+ * i.e. past the header on the encrypted side
+ */
+struct crypt_ctx
+{
+	const char *infile;
+	const char *outfile;
+	int infile_des;
+	int outfile_des;
+	BF_KEY *key;
+	int enc;
+	int mode;
+	int chunk_shift;
+	int mac;		/* every chunk is followed by its tag, see mac.c */
+	int compress;		/* every chunk is compressed, see compress.c */
+	unsigned char iv[8];
+	unsigned char check[8];	/* key check of the header, see header_check */
+	off_t in_base;
+	off_t out_base;
+	size_t block_size;	/* unit of I/O, see IO_BLOCK_MIN */
+};
+
+/* Buffers mapped by arena_alloc */
+struct arena
+{
+	unsigned char *base;
+	size_t len;
+};
+
+/*
+ * OFB keystream made ahead of time by a producer thread
+ * The ring holds KS_SLOTS slots of KS_SLOT_SIZE bytes, slot i % KS_SLOTS
+ * is ready to use while consumed <= i < produced. The counters and stop
+ * are protected by lock.
+ */
+#define KS_SLOTS 8
+#define KS_SLOT_SIZE (64 * 1024)
+
+struct keystream
+{
+	BF_KEY *key;
+	int chunk_shift;
+	unsigned char base_iv[8];
+	unsigned char iv[8];
+	int num;
+	unsigned char *ring;
+	unsigned long produced;
+	unsigned long consumed;
+	size_t pos;		/* bytes of slot consumed % KS_SLOTS already used */
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+};
+
+/*
+ * Write-behind on an output written from front to back, see wb_advance
+ * Everything before start is on disk, writeback has been started up to
+ * started and the data goes up to written
+ */
+#define WB_WINDOW (32 * 1024 * 1024)
+
+struct writebehind
+{
+	int file_des;		/* -1 if not a regular file */
+	off_t start;
+	off_t started;
+	off_t written;
+};
+
+/* Running cipher state at some position of the data */
+struct stream
+{
+	int mode;
+	int enc;
+	BF_KEY *key;
+	unsigned char iv[8];
+	unsigned char ecount[8];
+	int num;
+	struct keystream *ks;	/* OFB keystream to use instead of iv, if any */
+	off_t pos;		/* offset in the data, to know where chunks end */
+	int chunk_shift;
+	unsigned char base_iv[8];	/* IV in the header, for chunk_iv */
+};
+
+/* cipher.c */
+void close_file(const char *file, int file_des);
+
+/* header.c */
+void put64(unsigned char *p, uint64_t v);
+uint64_t get64(const unsigned char *p);
+void put32(unsigned char *p, uint32_t v);
+uint32_t get32(const unsigned char *p);
+void header_encode(const struct file_header *hdr, unsigned char *buf);
+int header_decode(const unsigned char *buf, size_t len, struct file_header *hdr);
+void header_check(BF_KEY *key, const struct file_header *hdr, unsigned char *check);
+int random_bytes(unsigned char *buf, size_t len);
+int header_setup(struct crypt_ctx *ctx, const struct encdec_opts *opts, unsigned char *buf,
+	ssize_t *buffered);
+
+/* stream.c */
+void chunk_iv(BF_KEY *key, const unsigned char *base_iv, off_t chunk, unsigned char *iv);
+void stream_init(struct stream *st, const struct crypt_ctx *ctx);
+int stream_seek(struct stream *st, const struct crypt_ctx *ctx, off_t offset);
+void stream_crypt(struct stream *st, unsigned char *in, unsigned char *out, size_t len);
+
+/* arena.c */
+size_t io_block_size(int infile_des, int outfile_des);
+unsigned char *arena_alloc(struct arena *arena, size_t len);
+void arena_free(struct arena *arena);
+
+/* hints.c */
+int prepare_files(const struct crypt_ctx *ctx, int direct);
+void wb_init(struct writebehind *wb, int file_des);
+void wb_advance(struct writebehind *wb, size_t len);
+
+/* keystream.c */
+int ks_start(struct keystream *ks, const struct crypt_ctx *ctx);
+void ks_xor(struct keystream *ks, const unsigned char *in, unsigned char *out, size_t len);
+void ks_stop(struct keystream *ks);
+
+/* cbc.c */
+int cbc_crypt_serial(const struct crypt_ctx *ctx);
+int cbc_crypt(const struct crypt_ctx *ctx, unsigned char *buffer);
+int cbc_data_size(const struct crypt_ctx *ctx, off_t size, off_t *data_size);
+int cbc_truncate(const struct crypt_ctx *ctx);
+
+/* parallel.c */
+ssize_t read_full(int fd, unsigned char *buf, size_t len);
+int file_size(int fd, off_t *size);
+ssize_t pread_full(int fd, unsigned char *buf, size_t len, off_t offset);
+int pwrite_full(int fd, const unsigned char *buf, size_t len, off_t offset);
+int write_full(int fd, const unsigned char *buf, size_t len);
+int crypt_parallel(const struct crypt_ctx *ctx, int jobs);
+
+/* pipeline.c */
+int crypt_pipeline(const struct crypt_ctx *ctx, struct stream *st);
+
+/* uring.c */
+int crypt_uring(const struct crypt_ctx *ctx, struct stream *st);
+
+/* mapping.c */
+int crypt_mmap(const struct crypt_ctx *ctx, struct stream *st);
+
+/* direct.c */
+int crypt_direct(const struct crypt_ctx *ctx, struct stream *st, int nontemporal);
+
+/* inplace.c */
+int crypt_inplace(const struct crypt_ctx *ctx, const char *journal);
+
+/* range.c */
+int decrypt_range(const struct crypt_ctx *ctx, off_t offset, off_t length);
+
+/* batch.c */
+int crypt_batch(const struct crypt_ctx *proto, const struct encdec_opts *opts, int jobs, FILE *list);
+
+/* mac.c */
+int crypt_mac(const struct crypt_ctx *ctx, int jobs, int verify);
+
+/* compress.c */
+int crypt_compressed(const struct crypt_ctx *ctx, int jobs);
+int compressed_range(const struct crypt_ctx *ctx, off_t offset, off_t length);
+
+/* archive.c */
+int archive_pack(const struct crypt_ctx *ctx);
+int archive_unpack(struct crypt_ctx *ctx, const char *dir);
+int archive_member(struct crypt_ctx *ctx, const char *name, int *emptied);
+
+#endif
@@ -0,0 +1,808 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "cipher.h"
+
+/*
+ * Compressed files: with -z every chunk of the data is compressed before
+ * it is encrypted, ciphertext being the one thing that doesn't compress.
+ * Each chunk is stored as a record:
+ *
+ *   header | record 0 | ... | record n | COMP_END | index | count
+ *
+ * A record is a 4 byte word, COMP_PACKED if the chunk is compressed and
+ * the number of bytes stored, followed by those bytes, encrypted as chunk
+ * n would be (see chunk_iv). A chunk that doesn't get at least
+ * COMP_MIN_SAVING smaller, i.e. data that is already compressed or
+ * encrypted, is stored as it is and costs nothing to read back. Every
+ * chunk but the last is full before compression. The index is the words
+ * of all of the records again, count the number of records, 8 bytes, so
+ * a range (see compressed_range) finds its chunks without reading the
+ * others.
+ *
+ * The compression is LZ4's block format: fast enough in both directions
+ * to keep up with the cipher, and on text such as logs it takes out most
+ * of what there is to take out.
+ *
+ * Chunks are read and written in order, by whichever of the workers has
+ * the next one, and compressed or decompressed and encrypted or decrypted
+ * in between, in parallel. Pipes work as well as files.
+ */
+
+#define COMP_PACKED 0x80000000U
+#define COMP_LEN_MASK 0x7fffffffU
+#define COMP_END 0xffffffffU
+#define COMP_MIN_SAVING 32	/* as 1 / COMP_MIN_SAVING of the chunk */
+
+/* LZ4 block format */
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5	/* the block ends with at least this many literals */
+#define LZ_MF_LIMIT 12		/* and no match starts any closer to the end */
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 14
+#define LZ_TABLE_SIZE ((1 << LZ_HASH_BITS) * sizeof(uint32_t))
+
+/*
+ * State shared by the workers
+ * next_read, eof and the reading itself are protected by read_lock,
+ * next_write, the index, the writing and the error fields by lock
+ */
+struct comp_state
+{
+	const struct crypt_ctx *ctx;
+	size_t chunk;		/* bytes per chunk */
+	off_t next_read;	/* chunk the next record read is */
+	int eof;
+	int cut;		/* the records ran out before COMP_END */
+	off_t next_write;	/* chunk whose turn it is to be written */
+	int short_chunk;	/* a chunk written was short, it has to be the last */
+	uint32_t *index;	/* words of the records written, when encrypting */
+	size_t index_cap;
+	struct writebehind wb;
+	int err;
+	const char *err_file;
+	off_t bad;		/* chunk that didn't decompress, or -1 */
+	pthread_mutex_t read_lock;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static uint32_t lz_read32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t lz_hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/*
+ * Writes the rest of a length that didn't fit in its token, len - 15
+ * Returns where the output goes on, or NULL if it doesn't fit before end
+ */
+static unsigned char *lz_put_len(unsigned char *op, unsigned char *end, size_t len)
+{
+	for (; len >= 255; len -= 255)
+	{
+		if (op == end)
+		{
+			return NULL;
+		}
+		*op++ = 255;
+	}
+	if (op == end)
+	{
+		return NULL;
+	}
+	*op++ = (unsigned char) len;
+	return op;
+}
+
+/*
+ * Writes a sequence: the literals from anchor to ip, then, unless it is
+ * the last, a match of match_len bytes offset back
+ * Returns where the output goes on, or NULL if it doesn't fit before end
+ */
+static unsigned char *lz_sequence(unsigned char *op, unsigned char *end, const unsigned char *anchor,
+	const unsigned char *ip, size_t offset, size_t match_len)
+{
+	size_t lit = ip - anchor;
+	unsigned char *token;
+
+	if (op == end)
+	{
+		return NULL;
+	}
+	token = op++;
+	*token = (unsigned char) ((lit < 15 ? lit : 15) << 4);
+	if (lit >= 15 && (op = lz_put_len(op, end, lit - 15)) == NULL)
+	{
+		return NULL;
+	}
+	if ((size_t) (end - op) < lit)
+	{
+		return NULL;
+	}
+	memcpy(op, anchor, lit);
+	op += lit;
+	if (match_len == 0)
+	{
+		return op;
+	}
+
+	if (end - op < 2)
+	{
+		return NULL;
+	}
+	*op++ = (unsigned char) offset;
+	*op++ = (unsigned char) (offset >> 8);
+	match_len -= LZ_MIN_MATCH;
+	*token |= (unsigned char) (match_len < 15 ? match_len : 15);
+	if (match_len >= 15 && (op = lz_put_len(op, end, match_len - 15)) == NULL)
+	{
+		return NULL;
+	}
+	return op;
+}
+
+/*
+ * Compresses the len bytes at src into at most cap bytes at dst, with
+ * table, LZ_TABLE_SIZE bytes, to find matches in
+ * The longer it goes without finding a match the further it skips ahead,
+ * so data that doesn't compress goes through quickly.
+ * Returns the size of the compressed data, or 0 if it doesn't fit
+ */
+static size_t lz_compress(const unsigned char *src, size_t len, unsigned char *dst, size_t cap,
+	uint32_t *table)
+{
+	const unsigned char *ip = src;
+	const unsigned char *anchor = src;
+	const unsigned char *ref;
+	const unsigned char *mf_limit = src + len - LZ_MF_LIMIT;
+	const unsigned char *match_limit = src + len - LZ_LAST_LITERALS;
+	unsigned char *op = dst;
+	unsigned char *end = dst + cap;
+	size_t match_len;
+	uint32_t h;
+
+	memset(table, 0, LZ_TABLE_SIZE);
+	if (len > LZ_MF_LIMIT)
+	{
+		ip++;
+		while (ip < mf_limit)
+		{
+			h = lz_hash(lz_read32(ip));
+			ref = src + table[h];
+			table[h] = (uint32_t) (ip - src);
+			if (ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != lz_read32(ip))
+			{
+				ip += 1 + ((ip - anchor) >> 6);
+				continue;
+			}
+
+			/* Take in as much in front as matches too, then what follows */
+			while (ip > anchor && ref > src && ip[-1] == ref[-1])
+			{
+				ip--;
+				ref--;
+			}
+			match_len = LZ_MIN_MATCH;
+			while (ip + match_len < match_limit && ip[match_len] == ref[match_len])
+			{
+				match_len++;
+			}
+
+			if ((op = lz_sequence(op, end, anchor, ip, ip - ref, match_len)) == NULL)
+			{
+				return 0;
+			}
+			ip += match_len;
+			anchor = ip;
+		}
+	}
+	if ((op = lz_sequence(op, end, anchor, src + len, 0, 0)) == NULL)
+	{
+		return 0;
+	}
+	return op - dst;
+}
+
+/*
+ * Decompresses the len bytes at src into at most cap bytes at dst
+ * Everything is checked, damaged data can't make it read or write past
+ * either buffer.
+ * Returns the size of the data, or -1 if src isn't valid compressed data
+ */
+static ssize_t lz_decompress(const unsigned char *src, size_t len, unsigned char *dst, size_t cap)
+{
+	const unsigned char *ip = src;
+	const unsigned char *ip_end = src + len;
+	unsigned char *op = dst;
+	unsigned char *op_end = dst + cap;
+	size_t lit;
+	size_t offset;
+	size_t match_len;
+	unsigned char token;
+	unsigned char b;
+
+	for (;;)
+	{
+		if (ip == ip_end)
+		{
+			return -1;
+		}
+		token = *ip++;
+		lit = token >> 4;
+		if (lit == 15)
+		{
+			do
+			{
+				if (ip == ip_end)
+				{
+					return -1;
+				}
+				b = *ip++;
+				lit += b;
+			} while (b == 255);
+		}
+		if ((size_t) (ip_end - ip) < lit || (size_t) (op_end - op) < lit)
+		{
+			return -1;
+		}
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		/* The last sequence has only literals */
+		if (ip == ip_end)
+		{
+			return op - dst;
+		}
+
+		if (ip_end - ip < 2)
+		{
+			return -1;
+		}
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (size_t) (op - dst))
+		{
+			return -1;
+		}
+		match_len = token & 15;
+		if (match_len == 15)
+		{
+			do
+			{
+				if (ip == ip_end)
+				{
+					return -1;
+				}
+				b = *ip++;
+				match_len += b;
+			} while (b == 255);
+		}
+		match_len += LZ_MIN_MATCH;
+		if ((size_t) (op_end - op) < match_len)
+		{
+			return -1;
+		}
+		/* A match can overlap what it copies, repeating it */
+		if (offset >= match_len)
+		{
+			memcpy(op, op - offset, match_len);
+			op += match_len;
+		}
+		else
+		{
+			for (; match_len > 0; match_len--, op++)
+			{
+				*op = op[-offset];
+			}
+		}
+	}
+}
+
+/*
+ * Turns the record of chunk n, its word and the stored bytes at payload,
+ * back into the data: decrypts it in place and decompresses it into out,
+ * a chunk in size, if it was compressed
+ * Returns the data and its length in *len, or NULL if it doesn't
+ * decompress
+ */
+static unsigned char *comp_decode(const struct crypt_ctx *ctx, off_t n, uint32_t word,
+	unsigned char *payload, unsigned char *out, size_t *len)
+{
+	size_t stored = word & COMP_LEN_MASK;
+	struct stream st;
+	ssize_t got;
+
+	stream_init(&st, ctx);
+	stream_seek(&st, ctx, n << ctx->chunk_shift);
+	stream_crypt(&st, payload, payload, stored);
+	memset(&st, 0, sizeof(st));
+	if (!(word & COMP_PACKED))
+	{
+		*len = stored;
+		return payload;
+	}
+	if ((got = lz_decompress(payload, stored, out, (size_t) 1 << ctx->chunk_shift)) < 0)
+	{
+		return NULL;
+	}
+	*len = got;
+	return out;
+}
+
+/*
+ * Records the first error hit by any worker, err an errno value or 0 if
+ * chunk bad didn't decompress; the rest stop
+ */
+static void comp_fail(struct comp_state *cs, const char *file, int err, off_t bad)
+{
+	pthread_mutex_lock(&cs->lock);
+	if (cs->err == 0 && cs->bad < 0)
+	{
+		cs->err = err;
+		cs->err_file = file;
+		cs->bad = bad;
+	}
+	pthread_cond_broadcast(&cs->cond);
+	pthread_mutex_unlock(&cs->lock);
+}
+
+/*
+ * Says whether a worker has failed
+ */
+static int comp_failed(struct comp_state *cs)
+{
+	int failed;
+
+	pthread_mutex_lock(&cs->lock);
+	failed = cs->err != 0 || cs->bad >= 0;
+	pthread_mutex_unlock(&cs->lock);
+	return failed;
+}
+
+/*
+ * Reads the next record of infile, the word and the stored bytes, into
+ * payload and *word, or when encrypting the next chunk into payload
+ * Returns the chunk number, -1 at the end of the data, or -2 if it fails,
+ * after recording the error
+ */
+static off_t comp_read(struct comp_state *cs, unsigned char *payload, uint32_t *word)
+{
+	const struct crypt_ctx *ctx = cs->ctx;
+	unsigned char head[4];
+	ssize_t got;
+	size_t want;
+	off_t n = -1;
+
+	pthread_mutex_lock(&cs->read_lock);
+	if (cs->eof || comp_failed(cs))
+	{
+		pthread_mutex_unlock(&cs->read_lock);
+		return -1;
+	}
+
+	if (ctx->enc)
+	{
+		if ((got = read_full(ctx->infile_des, payload, cs->chunk)) < 0)
+		{
+			comp_fail(cs, ctx->infile, errno, -1);
+			n = -2;
+		}
+		else
+		{
+			cs->eof = (size_t) got < cs->chunk;
+			*word = got;
+			if (got > 0)
+			{
+				n = cs->next_read++;
+			}
+		}
+		pthread_mutex_unlock(&cs->read_lock);
+		return n;
+	}
+
+	if ((got = read_full(ctx->infile_des, head, sizeof(head))) < 0)
+	{
+		comp_fail(cs, ctx->infile, errno, -1);
+		n = -2;
+	}
+	else if (got == sizeof(head) && get32(head) == COMP_END)
+	{
+		/* The index after it is only for ranges */
+		cs->eof = 1;
+	}
+	else if (got != sizeof(head) || (want = get32(head) & COMP_LEN_MASK) > cs->chunk ||
+		(got = read_full(ctx->infile_des, payload, want)) != (ssize_t) want)
+	{
+		if (got < 0)
+		{
+			comp_fail(cs, ctx->infile, errno, -1);
+			n = -2;
+		}
+		else
+		{
+			cs->eof = 1;
+			cs->cut = 1;
+		}
+	}
+	else
+	{
+		*word = get32(head);
+		n = cs->next_read++;
+	}
+	pthread_mutex_unlock(&cs->read_lock);
+	return n;
+}
+
+/*
+ * Writes chunk n, len bytes at data, once all of the chunks in front of it
+ * are written; when encrypting data is the record, word its first 4 bytes
+ * Returns 0 on success, otherwise records the error and returns -1
+ */
+static int comp_write(struct comp_state *cs, off_t n, const unsigned char *data, size_t len,
+	uint32_t word)
+{
+	const struct crypt_ctx *ctx = cs->ctx;
+	uint32_t *index;
+	int ret = 0;
+
+	pthread_mutex_lock(&cs->lock);
+	while (cs->next_write != n && cs->err == 0 && cs->bad < 0)
+	{
+		pthread_cond_wait(&cs->cond, &cs->lock);
+	}
+	if (cs->err != 0 || cs->bad >= 0)
+	{
+		pthread_mutex_unlock(&cs->lock);
+		return -1;
+	}
+
+	if (ctx->enc && (size_t) n == cs->index_cap)
+	{
+		cs->index_cap = cs->index_cap != 0 ? 2 * cs->index_cap : 1024;
+		if ((index = realloc(cs->index, cs->index_cap * sizeof(*index))) == NULL)
+		{
+			cs->err = errno;
+			cs->err_file = ctx->outfile;
+			ret = -1;
+		}
+		else
+		{
+			cs->index = index;
+		}
+	}
+	else if (!ctx->enc && cs->short_chunk)
+	{
+		/* Only the last chunk can be short */
+		cs->bad = n;
+		ret = -1;
+	}
+	if (ret == 0 && write_full(ctx->outfile_des, data, len) < 0)
+	{
+		cs->err = errno;
+		cs->err_file = ctx->outfile;
+		ret = -1;
+	}
+	if (ret == 0)
+	{
+		wb_advance(&cs->wb, len);
+		if (ctx->enc)
+		{
+			cs->index[n] = word;
+		}
+		else
+		{
+			cs->short_chunk = len < cs->chunk;
+		}
+		cs->next_write++;
+	}
+	pthread_cond_broadcast(&cs->cond);
+	pthread_mutex_unlock(&cs->lock);
+	return ret;
+}
+
+/*
+ * Worker thread: reads, does and writes one chunk after the other until
+ * the data is done
+ */
+static void *comp_worker(void *arg)
+{
+	struct comp_state *cs = arg;
+	const struct crypt_ctx *ctx = cs->ctx;
+	struct arena arena;
+	struct stream st;
+	unsigned char *in;
+	unsigned char *out;
+	unsigned char *data;
+	uint32_t *table;
+	uint32_t word;
+	size_t len;
+	size_t packed;
+	off_t n;
+
+	/* Room for the word in front of the chunk in both buffers */
+	if ((in = arena_alloc(&arena, 2 * (cs->chunk + 4) + LZ_TABLE_SIZE)) == NULL)
+	{
+		comp_fail(cs, ctx->infile, errno, -1);
+		return NULL;
+	}
+	out = in + cs->chunk + 4;
+	table = (uint32_t *) (out + cs->chunk + 4);
+	in += 4;
+	out += 4;
+
+	while ((n = comp_read(cs, in, &word)) >= 0)
+	{
+		if (!ctx->enc)
+		{
+			if ((data = comp_decode(ctx, n, word, in, out, &len)) == NULL)
+			{
+				comp_fail(cs, ctx->infile, 0, n);
+				break;
+			}
+			if (comp_write(cs, n, data, len, word) < 0)
+			{
+				break;
+			}
+			continue;
+		}
+
+		/* Only worth keeping compressed if it saves something */
+		len = word;
+		data = in;
+		packed = lz_compress(in, len, out, len - len / COMP_MIN_SAVING - 1, table);
+		if (packed != 0)
+		{
+			data = out;
+			len = packed;
+			word = COMP_PACKED | (uint32_t) packed;
+		}
+		stream_init(&st, ctx);
+		stream_seek(&st, ctx, n << ctx->chunk_shift);
+		stream_crypt(&st, data, data, len);
+		put32(data - 4, word);
+		if (comp_write(cs, n, data - 4, len + 4, word) < 0)
+		{
+			break;
+		}
+	}
+
+	memset(&st, 0, sizeof(st));
+	arena_free(&arena);
+	return NULL;
+}
+
+/*
+ * Writes the end of a compressed file, the index of the n records
+ * Returns 0 on success or -1 with errno set
+ */
+static int comp_index(struct comp_state *cs, off_t n)
+{
+	unsigned char *buf;
+	size_t len = 4 + 4 * n + 8;
+	off_t i;
+	int ret;
+
+	if ((buf = malloc(len)) == NULL)
+	{
+		return -1;
+	}
+	put32(buf, COMP_END);
+	for (i = 0; i < n; i++)
+	{
+		put32(buf + 4 + 4 * i, cs->index[i]);
+	}
+	put64(buf + 4 + 4 * n, n);
+	ret = write_full(cs->ctx->outfile_des, buf, len);
+	free(buf);
+	return ret;
+}
+
+/*
+ * Runs the data of ctx, a compressed file (see above) when decrypting,
+ * through compression and the cipher in jobs threads, or the other way
+ * around. Either file may be a pipe.
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+int crypt_compressed(const struct crypt_ctx *ctx, int jobs)
+{
+	struct comp_state cs;
+	pthread_t *threads;
+	int started;
+	int err;
+	int i;
+	int ret = 0;
+
+	memset(&cs, 0, sizeof(cs));
+	cs.ctx = ctx;
+	cs.chunk = (size_t) 1 << ctx->chunk_shift;
+	cs.bad = -1;
+	wb_init(&cs.wb, ctx->outfile_des);
+	pthread_mutex_init(&cs.read_lock, NULL);
+	pthread_mutex_init(&cs.lock, NULL);
+	pthread_cond_init(&cs.cond, NULL);
+
+	if ((threads = malloc(sizeof(pthread_t) * jobs)) == NULL)
+	{
+		fprintf(stderr, "%s\n", strerror(errno));
+		ret = -1;
+	}
+	for (started = 0; ret == 0 && started < jobs - 1; started++)
+	{
+		if ((err = pthread_create(&threads[started], NULL, comp_worker, &cs)) != 0)
+		{
+			comp_fail(&cs, ctx->infile, err, -1);
+			break;
+		}
+	}
+	/* This thread is one of the workers */
+	if (ret == 0)
+	{
+		comp_worker(&cs);
+	}
+	for (i = 0; ret == 0 && i < started; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+
+	if (ret == 0 && cs.bad >= 0)
+	{
+		fprintf(stderr, "%s: chunk %lld is damaged, it doesn't decompress\n", ctx->infile,
+			(long long) cs.bad);
+		ret = -1;
+	}
+	else if (ret == 0 && cs.err != 0)
+	{
+		fprintf(stderr, "%s: %s\n", cs.err_file, strerror(cs.err));
+		ret = -1;
+	}
+	else if (ret == 0 && cs.cut)
+	{
+		fprintf(stderr, "%s: cut short or damaged, the end of the data is missing\n", ctx->infile);
+		ret = -1;
+	}
+	else if (ret == 0 && ctx->enc && comp_index(&cs, cs.next_write) < 0)
+	{
+		perror(ctx->outfile);
+		ret = -1;
+	}
+
+	free(cs.index);
+	pthread_cond_destroy(&cs.cond);
+	pthread_mutex_destroy(&cs.lock);
+	pthread_mutex_destroy(&cs.read_lock);
+	return ret;
+}
+
+/*
+ * Decrypts only the length bytes at offset of the data in the compressed
+ * file ctx->infile onto ctx->outfile, reading the index and the records of
+ * the chunks the range is in
+ * A range reaching past the end of infile stops at the end
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+int compressed_range(const struct crypt_ctx *ctx, off_t offset, off_t length)
+{
+	size_t chunk = (size_t) 1 << ctx->chunk_shift;
+	struct arena arena;
+	unsigned char tail[12];
+	unsigned char *index = NULL;
+	unsigned char *in;
+	unsigned char *out;
+	unsigned char *data;
+	off_t size;
+	off_t count;
+	off_t record;
+	off_t n;
+	off_t i;
+	size_t len;
+	size_t skip;
+	size_t want;
+	uint32_t word;
+	int ret = -1;
+
+	/* The count at the very end, the index and COMP_END in front of it */
+	if (file_size(ctx->infile_des, &size) < 0)
+	{
+		perror(ctx->infile);
+		return -1;
+	}
+	size -= ctx->in_base;
+	if (size < (off_t) sizeof(tail) ||
+		pread_full(ctx->infile_des, tail, sizeof(tail), ctx->in_base + size - sizeof(tail)) != sizeof(tail) ||
+		(count = get64(tail + 4)) < 0 || count > (size - (off_t) sizeof(tail)) / 4 ||
+		(index = malloc(4 * count + 4)) == NULL ||
+		pread_full(ctx->infile_des, index, 4 * count + 4, ctx->in_base + size - sizeof(tail) - 4 * count) !=
+		4 * count + 4 || get32(index) != COMP_END)
+	{
+		fprintf(stderr, "%s: cut short or damaged, its index is missing\n", ctx->infile);
+		free(index);
+		return -1;
+	}
+
+	/* Nothing in it, a range can only be empty */
+	if (count == 0)
+	{
+		free(index);
+		if (offset > 0)
+		{
+			fprintf(stderr, "Error: range starts past the end of %s\n", ctx->infile);
+			return -1;
+		}
+		return 0;
+	}
+
+	if ((in = arena_alloc(&arena, 2 * chunk)) == NULL)
+	{
+		fprintf(stderr, "%s\n", strerror(errno));
+		free(index);
+		return -1;
+	}
+	out = in + chunk;
+
+	/* Where the record of the first chunk of the range is */
+	n = offset >> ctx->chunk_shift;
+	if (n >= count)
+	{
+		n = count - 1;
+	}
+	record = 0;
+	for (i = 0; i < n; i++)
+	{
+		record += 4 + (get32(index + 4 + 4 * i) & COMP_LEN_MASK);
+	}
+	skip = offset - (n << ctx->chunk_shift);
+
+	for (;;)
+	{
+		word = get32(index + 4 + 4 * n);
+		len = word & COMP_LEN_MASK;
+		if (len > chunk || pread_full(ctx->infile_des, in, len, ctx->in_base + record + 4) != (ssize_t) len)
+		{
+			fprintf(stderr, "%s: cut short or damaged\n", ctx->infile);
+			break;
+		}
+		if ((data = comp_decode(ctx, n, word, in, out, &len)) == NULL)
+		{
+			fprintf(stderr, "%s: chunk %lld is damaged, it doesn't decompress\n", ctx->infile,
+				(long long) n);
+			break;
+		}
+		if (skip > len)
+		{
+			fprintf(stderr, "Error: range starts past the end of %s\n", ctx->infile);
+			break;
+		}
+		want = len - skip < (size_t) length ? len - skip : (size_t) length;
+		if (write_full(ctx->outfile_des, data + skip, want) < 0)
+		{
+			perror(ctx->outfile);
+			break;
+		}
+		record += 4 + (word & COMP_LEN_MASK);
+		length -= want;
+		skip = 0;
+		if (length == 0 || ++n == count)
+		{
+			ret = 0;
+			break;
+		}
+	}
+
+	arena_free(&arena);
+	free(index);
+	return ret;
+}
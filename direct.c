@@ -0,0 +1,328 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "cipher.h"
+
+/*
+ * The serial path with O_DIRECT: reads and writes go straight between the
+ * disk and the buffers, bypassing the page cache, so encrypting a huge
+ * file doesn't push everything else on the machine out of memory.
+ *
+ * Direct I/O has to be done in whole, aligned blocks at aligned offsets.
+ * The data doesn't start on one in either file (the header) and doesn't
+ * end on one, so the input is read from the block the data starts in and
+ * the output is built up in a second buffer that starts with whatever is
+ * already in front of the data in outfile. The last block is written out
+ * in full and outfile is cut back to size afterwards.
+ */
+
+/* Alignment for direct I/O, what the block size is a multiple of */
+#define DIRECT_ALIGN IO_BLOCK_MIN
+
+/* Bytes encrypted at a time into the scratch buffer when the output is
+ * written with non-temporal stores, small enough to stay in L1 */
+#define NT_SCRATCH_SIZE (16 * 1024)
+
+/*
+ * Copies len bytes from src to dst with non-temporal stores, which go
+ * to memory without pulling dst into the cache: the buffer is only going
+ * to be read by the disk, the cache is better used for something else
+ */
+static void nt_copy(unsigned char *dst, const unsigned char *src, size_t len)
+{
+#ifdef __SSE2__
+	size_t head = (16 - ((uintptr_t) dst & 15)) & 15;
+	size_t i;
+
+	if (head > len)
+	{
+		head = len;
+	}
+	memcpy(dst, src, head);
+	for (i = head; i + 16 <= len; i += 16)
+	{
+		_mm_stream_si128((__m128i *) (dst + i), _mm_loadu_si128((const __m128i *) (src + i)));
+	}
+	memcpy(dst + i, src + i, len - i);
+#else
+	memcpy(dst, src, len);
+#endif
+}
+
+/*
+ * Runs len bytes from in through st onto out, through a scratch buffer
+ * and nt_copy if nontemporal is set
+ */
+static void direct_crypt(struct stream *st, unsigned char *in, unsigned char *out, size_t len,
+	int nontemporal)
+{
+	unsigned char scratch[NT_SCRATCH_SIZE] __attribute__((aligned(64)));
+	size_t n;
+
+	if (!nontemporal)
+	{
+		stream_crypt(st, in, out, len);
+		return;
+	}
+	while (len > 0)
+	{
+		n = len < NT_SCRATCH_SIZE ? len : NT_SCRATCH_SIZE;
+		stream_crypt(st, in, scratch, n);
+		nt_copy(out, scratch, n);
+		in += n;
+		out += n;
+		len -= n;
+	}
+#ifdef __SSE2__
+	/* Non-temporal stores aren't ordered, make sure they are all in
+	 * memory before the buffer goes to the disk */
+	_mm_sfence();
+#endif
+	memset(scratch, 0, sizeof(scratch));
+}
+
+/*
+ * The loop of crypt_direct, in_buf and out_buf are ctx->block_size bytes
+ * The data is size bytes at in_start in infile and goes to out_start in
+ * outfile, the bytes of out_buf in front of out_start (out_start is
+ * within its first block) are already filled in
+ * device says outfile is a block device, which can't be cut to size
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+static int direct_loop(const struct crypt_ctx *ctx, struct stream *st, int nontemporal,
+	unsigned char *in_buf, unsigned char *out_buf, off_t in_start, off_t out_start, off_t size,
+	int device)
+{
+	size_t block = ctx->block_size;
+	off_t in_offset = in_start & ~(off_t) (DIRECT_ALIGN - 1);
+	off_t out_offset = out_start & ~(off_t) (DIRECT_ALIGN - 1);
+	off_t in_end = in_start + size;
+	size_t in_pos = in_start - in_offset;	/* next byte of in_buf to use */
+	size_t in_len = 0;			/* bytes of in_buf read */
+	size_t out_pos = out_start - out_offset;
+	size_t want;
+	ssize_t bytes_read;
+	size_t n;
+	int flags;
+
+	while (in_offset + (off_t) in_pos < in_end)
+	{
+		if (in_len == 0 || in_pos == in_len)
+		{
+			if (in_len != 0)
+			{
+				in_offset += in_len;
+				in_pos = 0;
+			}
+			/* Only the read of the last block can come back short */
+			want = in_end - in_offset < (off_t) block ? in_end - in_offset : block;
+			while ((bytes_read = pread(ctx->infile_des, in_buf, block, in_offset)) < 0 && errno == EINTR)
+			{
+			}
+			if (bytes_read < 0 || (size_t) bytes_read < want)
+			{
+				/* Not the size it was a moment ago */
+				if (bytes_read >= 0)
+				{
+					errno = EIO;
+				}
+				perror(ctx->infile);
+				return -1;
+			}
+			in_len = want;
+		}
+
+		n = in_len - in_pos < block - out_pos ? in_len - in_pos : block - out_pos;
+		direct_crypt(st, in_buf + in_pos, out_buf + out_pos, n, nontemporal);
+		in_pos += n;
+		out_pos += n;
+
+		if (out_pos == block)
+		{
+			if (pwrite_full(ctx->outfile_des, out_buf, block, out_offset) < 0)
+			{
+				perror(ctx->outfile);
+				return -1;
+			}
+			out_offset += block;
+			out_pos = 0;
+		}
+	}
+
+	/* A device can't be cut back to size and what is on it past the data
+	 * has to stay: the whole blocks of the end go out direct, the rest
+	 * through the page cache, which reads the block in around it */
+	if (device && (out_pos & (DIRECT_ALIGN - 1)) != 0)
+	{
+		want = out_pos & ~(size_t) (DIRECT_ALIGN - 1);
+		if ((want > 0 && pwrite_full(ctx->outfile_des, out_buf, want, out_offset) < 0) ||
+			(flags = fcntl(ctx->outfile_des, F_GETFL)) < 0 ||
+			fcntl(ctx->outfile_des, F_SETFL, flags & ~O_DIRECT) < 0 ||
+			pwrite_full(ctx->outfile_des, out_buf + want, out_pos - want, out_offset + want) < 0)
+		{
+			perror(ctx->outfile);
+			return -1;
+		}
+		return 0;
+	}
+
+	/* The last block goes out whole, what is past the data is cut off below */
+	if (out_pos > 0)
+	{
+		want = (out_pos + DIRECT_ALIGN - 1) & ~(size_t) (DIRECT_ALIGN - 1);
+		memset(out_buf + out_pos, 0, want - out_pos);
+		if (pwrite_full(ctx->outfile_des, out_buf, want, out_offset) < 0)
+		{
+			perror(ctx->outfile);
+			return -1;
+		}
+	}
+	if (!device && ftruncate(ctx->outfile_des, out_start + size) < 0)
+	{
+		perror(ctx->outfile);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Tries a direct read of the first block of the data into in_buf, and a
+ * direct write of the first block of outfile, unless there is nothing at
+ * all to write. For a file that is out_buf, which has what is in front of
+ * out_start in that block; a device gets back what it has there, read
+ * into in_buf, as the loop doesn't write over what is past the data.
+ * Returns -1 if either is turned down with EINVAL, else 0; any other
+ * error is left to direct_loop to run into and report
+ */
+static int direct_probe(const struct crypt_ctx *ctx, unsigned char *in_buf, unsigned char *out_buf,
+	off_t in_start, off_t out_start, off_t size, int device)
+{
+	size_t head = out_start & (DIRECT_ALIGN - 1);
+	off_t out_offset = out_start & ~(off_t) (DIRECT_ALIGN - 1);
+	ssize_t ret;
+
+	while ((ret = pread(ctx->infile_des, in_buf, DIRECT_ALIGN,
+		in_start & ~(off_t) (DIRECT_ALIGN - 1))) < 0 && errno == EINTR)
+	{
+	}
+	if (ret < 0 && errno == EINVAL)
+	{
+		return -1;
+	}
+	if (size == 0 && head == 0)
+	{
+		return 0;
+	}
+
+	if (device)
+	{
+		while ((ret = pread(ctx->outfile_des, in_buf, DIRECT_ALIGN, out_offset)) < 0 && errno == EINTR)
+		{
+		}
+		if (ret < 0 && errno == EINVAL)
+		{
+			return -1;
+		}
+		/* The end of the device is in the block, there is nothing to try */
+		if (ret != DIRECT_ALIGN)
+		{
+			return 0;
+		}
+	}
+	else
+	{
+		memset(out_buf + head, 0, DIRECT_ALIGN - head);
+	}
+	while ((ret = pwrite(ctx->outfile_des, device ? in_buf : out_buf, DIRECT_ALIGN, out_offset)) < 0 &&
+		errno == EINTR)
+	{
+	}
+	return ret < 0 && errno == EINVAL ? -1 : 0;
+}
+
+/*
+ * Runs the rest of ctx->infile through st onto ctx->outfile with O_DIRECT
+ * Both have to be block devices or regular files on a file system that
+ * does direct I/O and outfile has to be open for reading too; the data
+ * starts at their current offsets. If nontemporal is set the output is
+ * written to the buffers with non-temporal stores so it doesn't go
+ * through the cache either.
+ * Returns 0 on success, 1 if direct I/O can't be used for these files, in
+ * which case nothing has been read or written, otherwise prints the error
+ * and returns -1
+ */
+int crypt_direct(const struct crypt_ctx *ctx, struct stream *st, int nontemporal)
+{
+	struct stat infile_stat;
+	struct stat outfile_stat;
+	struct arena arena;
+	unsigned char *in_buf;
+	unsigned char *out_buf;
+	off_t in_start;
+	off_t out_start;
+	off_t size;
+	int in_flags;
+	int out_flags;
+	int ret;
+
+	if (fstat(ctx->infile_des, &infile_stat) < 0 || fstat(ctx->outfile_des, &outfile_stat) < 0 ||
+		!(S_ISREG(infile_stat.st_mode) || S_ISBLK(infile_stat.st_mode)) ||
+		!(S_ISREG(outfile_stat.st_mode) || S_ISBLK(outfile_stat.st_mode)) ||
+		file_size(ctx->infile_des, &size) < 0 ||
+		(in_start = lseek(ctx->infile_des, 0, SEEK_CUR)) < 0 ||
+		(out_start = lseek(ctx->outfile_des, 0, SEEK_CUR)) < 0 ||
+		(in_flags = fcntl(ctx->infile_des, F_GETFL)) < 0 ||
+		(out_flags = fcntl(ctx->outfile_des, F_GETFL)) < 0)
+	{
+		return 1;
+	}
+	size = size > in_start ? size - in_start : 0;
+
+	/* Both buffers in one arena, the output one first */
+	if ((out_buf = arena_alloc(&arena, 2 * ctx->block_size)) == NULL)
+	{
+		return 1;
+	}
+	in_buf = out_buf + ctx->block_size;
+
+	/* Whatever is in front of the data in its first block, i.e. the
+	 * header, gets written again along with it */
+	if (pread_full(ctx->outfile_des, out_buf, out_start & (DIRECT_ALIGN - 1),
+		out_start & ~(off_t) (DIRECT_ALIGN - 1)) != (out_start & (DIRECT_ALIGN - 1)))
+	{
+		arena_free(&arena);
+		return 1;
+	}
+
+	/* tmpfs and some network file systems don't do direct I/O, and some
+	 * take O_DIRECT only to turn down the reads or writes with EINVAL.
+	 * That has to be known before the loop, st can't be wound back once
+	 * it has run over the first block, so one block of each is tried
+	 * first, see direct_probe. */
+	if (fcntl(ctx->infile_des, F_SETFL, in_flags | O_DIRECT) < 0 ||
+		fcntl(ctx->outfile_des, F_SETFL, out_flags | O_DIRECT) < 0 ||
+		direct_probe(ctx, in_buf, out_buf, in_start, out_start, size,
+		S_ISBLK(outfile_stat.st_mode)) < 0)
+	{
+		fcntl(ctx->infile_des, F_SETFL, in_flags);
+		fcntl(ctx->outfile_des, F_SETFL, out_flags);
+		arena_free(&arena);
+		return 1;
+	}
+
+	ret = direct_loop(ctx, st, nontemporal, in_buf, out_buf, in_start, out_start, size,
+		S_ISBLK(outfile_stat.st_mode));
+
+	fcntl(ctx->infile_des, F_SETFL, in_flags);
+	fcntl(ctx->outfile_des, F_SETFL, out_flags);
+	arena_free(&arena);
+	return ret;
+}
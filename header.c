@@ -0,0 +1,296 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include "cipher.h"
+
+/*
+ * Stores v as 8 bytes big endian at p
+ */
+void put64(unsigned char *p, uint64_t v)
+{
+	int i;
+
+	for (i = 7; i >= 0; i--, v >>= 8)
+	{
+		p[i] = (unsigned char) v;
+	}
+}
+
+/*
+ * Loads 8 bytes big endian from p
+ */
+uint64_t get64(const unsigned char *p)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+	{
+		v = (v << 8) | p[i];
+	}
+	return v;
+}
+
+/*
+ * Stores v as 4 bytes big endian at p
+ */
+void put32(unsigned char *p, uint32_t v)
+{
+	p[0] = (unsigned char) (v >> 24);
+	p[1] = (unsigned char) (v >> 16);
+	p[2] = (unsigned char) (v >> 8);
+	p[3] = (unsigned char) v;
+}
+
+/*
+ * Loads 4 bytes big endian from p
+ */
+uint32_t get32(const unsigned char *p)
+{
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+/*
+ * Serialises hdr, a current version one, into the HEADER_SIZE bytes at buf
+ */
+void header_encode(const struct file_header *hdr, unsigned char *buf)
+{
+	memset(buf, 0, HEADER_SIZE);
+	memcpy(buf, HEADER_MAGIC, HEADER_MAGIC_LEN);
+	buf[8] = (unsigned char) hdr->version;
+	buf[9] = (unsigned char) hdr->mode;
+	buf[10] = (unsigned char) hdr->chunk_shift;
+	buf[11] = (unsigned char) hdr->flags;
+	memcpy(buf + 16, hdr->iv, 8);
+	memcpy(buf + 24, hdr->check, 8);
+}
+
+/*
+ * Parses the first len bytes of a file
+ * Returns 1 if they hold a header this version understands,
+ * 0 if the file has no header (it is headerless CFB-64),
+ * -1 if it has a header that can't be read (other version, unknown mode,
+ * chunk size or flags, cut short)
+ */
+int header_decode(const unsigned char *buf, size_t len, struct file_header *hdr)
+{
+	if (len < HEADER_MAGIC_LEN || memcmp(buf, HEADER_MAGIC, HEADER_MAGIC_LEN) != 0)
+	{
+		return 0;
+	}
+	if (len < HEADER_SIZE)
+	{
+		return -1;
+	}
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->version = buf[8];
+	hdr->mode = buf[9];
+	hdr->chunk_shift = buf[10];
+	hdr->flags = buf[11];
+	memcpy(hdr->iv, buf + 16, 8);
+	memcpy(hdr->check, buf + 24, 8);
+	if (hdr->version != HEADER_VERSION || hdr->mode < MODE_CFB64 || hdr->mode > MODE_LAST)
+	{
+		return -1;
+	}
+	/* CBC pads the end of the data, not of every chunk */
+	if (hdr->chunk_shift != 0 && (hdr->chunk_shift < CHUNK_SHIFT_MIN ||
+		hdr->chunk_shift > CHUNK_SHIFT_MAX || hdr->mode == MODE_CBC))
+	{
+		return -1;
+	}
+	/* Tags and compression go by chunks, and don't go together (yet) */
+	if ((hdr->flags & ~(HEADER_FLAG_MAC | HEADER_FLAG_COMPRESS)) != 0 ||
+		(hdr->flags != 0 && hdr->chunk_shift == 0) ||
+		hdr->flags == (HEADER_FLAG_MAC | HEADER_FLAG_COMPRESS))
+	{
+		return -1;
+	}
+	return 1;
+}
+
+/*
+ * Works out the key check of hdr: its IV xored with "BFKEYCHK",
+ * encrypted, xored with the version, mode, chunk size and flags as they
+ * are in bytes 8 to 15 of the header and encrypted again. Only the key the file was encrypted with gives the
+ * check in its header, so a wrong password is caught before any data is
+ * decrypted, and so is a header changed since, a flag cleared or a mode
+ * swapped, which would otherwise decrypt to garbage or skip the tags. The
+ * IV is random, so no two files share a check, and the xor keeps it from
+ * being one of the blocks the modes encrypt to make their keystream.
+ */
+void header_check(BF_KEY *key, const struct file_header *hdr, unsigned char *check)
+{
+	static const unsigned char tweak[8] = "BFKEYCHK";
+	unsigned char fields[8];
+	int i;
+
+	for (i = 0; i < 8; i++)
+	{
+		check[i] = hdr->iv[i] ^ tweak[i];
+	}
+	BF_ecb_encrypt(check, check, key, BF_ENCRYPT);
+
+	memset(fields, 0, sizeof(fields));
+	fields[0] = (unsigned char) hdr->version;
+	fields[1] = (unsigned char) hdr->mode;
+	fields[2] = (unsigned char) hdr->chunk_shift;
+	fields[3] = (unsigned char) hdr->flags;
+	for (i = 0; i < 8; i++)
+	{
+		check[i] ^= fields[i];
+	}
+	BF_ecb_encrypt(check, check, key, BF_ENCRYPT);
+}
+
+/*
+ * Fills buf with len bytes from the kernel's random number generator,
+ * with getrandom, or /dev/urandom on kernels without it
+ * Returns 0 on success or -1 with errno set
+ */
+int random_bytes(unsigned char *buf, size_t len)
+{
+	int fd;
+	ssize_t ret;
+
+	/* One call instead of an open, read and close, which adds up in --batch */
+	while ((ret = getrandom(buf, len, 0)) < 0 && errno == EINTR)
+	{
+	}
+	if (ret >= 0 && (size_t) ret == len)
+	{
+		return 0;
+	}
+	if (ret >= 0 || errno != ENOSYS)
+	{
+		if (ret >= 0)
+		{
+			errno = EIO;
+		}
+		return -1;
+	}
+
+	if ((fd = open("/dev/urandom", O_RDONLY)) < 0)
+	{
+		return -1;
+	}
+	ret = read_full(fd, buf, len);
+	close(fd);
+	if (ret < 0)
+	{
+		return -1;
+	}
+	if ((size_t) ret != len)
+	{
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Checks the key of ctx against the check in hdr
+ * Returns 0 if it is the one, otherwise prints the error and returns -1
+ */
+static int header_verify(const struct crypt_ctx *ctx, const struct file_header *hdr)
+{
+	unsigned char check[8];
+	int ret = 0;
+
+	header_check(ctx->key, hdr, check);
+	if (memcmp(check, hdr->check, sizeof(check)) != 0)
+	{
+		fprintf(stderr, "%s: wrong password, or the header has been changed\n", ctx->infile);
+		ret = -1;
+	}
+	memset(check, 0, sizeof(check));
+	return ret;
+}
+
+/*
+ * Sets ctx, fresh with both files at their start, up for the data as opts
+ * says: headerless data goes by opts, encryption writes a header,
+ * decryption goes by the header if infile has one, and if it has a key
+ * check makes sure the key is the right one. What was read looking for a
+ * header and turned out to be data is left in the HEADER_SIZE bytes at
+ * buf, *buffered of them.
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+int header_setup(struct crypt_ctx *ctx, const struct encdec_opts *opts, unsigned char *buf,
+	ssize_t *buffered)
+{
+	struct file_header hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	*buffered = 0;
+	if (opts->headerless)
+	{
+		ctx->mode = opts->mode;
+		ctx->chunk_shift = opts->chunk_shift;
+		memcpy(ctx->iv, opts->iv, sizeof(ctx->iv));
+		return 0;
+	}
+
+	if (ctx->enc)
+	{
+		hdr.mode = opts->mode;
+		hdr.chunk_shift = opts->chunk_shift;
+		hdr.flags = (opts->mac ? HEADER_FLAG_MAC : 0) | (opts->compress ? HEADER_FLAG_COMPRESS : 0);
+		hdr.version = HEADER_VERSION;
+		if (random_bytes(hdr.iv, sizeof(hdr.iv)) < 0)
+		{
+			perror("/dev/urandom");
+			return -1;
+		}
+		header_check(ctx->key, &hdr, hdr.check);
+		header_encode(&hdr, buf);
+		if (write_full(ctx->outfile_des, buf, HEADER_SIZE) < 0)
+		{
+			perror(ctx->outfile);
+			return -1;
+		}
+		ctx->mode = hdr.mode;
+		ctx->chunk_shift = hdr.chunk_shift;
+		ctx->mac = opts->mac;
+		ctx->compress = opts->compress;
+		memcpy(ctx->iv, hdr.iv, sizeof(ctx->iv));
+		memcpy(ctx->check, hdr.check, sizeof(ctx->check));
+		ctx->out_base = HEADER_SIZE;
+		return 0;
+	}
+
+	/* Look for a header, keeping what was read if there is none */
+	if ((*buffered = read_full(ctx->infile_des, buf, HEADER_SIZE)) < 0)
+	{
+		perror(ctx->infile);
+		return -1;
+	}
+	if (*buffered >= HEADER_MAGIC_LEN && memcmp(buf, ARCHIVE_MAGIC, HEADER_MAGIC_LEN) == 0)
+	{
+		fprintf(stderr, "%s is an archive, use --archive\n", ctx->infile);
+		return -1;
+	}
+	switch (header_decode(buf, *buffered, &hdr))
+	{
+		case 1:
+			ctx->mode = hdr.mode;
+			ctx->chunk_shift = hdr.chunk_shift;
+			ctx->mac = (hdr.flags & HEADER_FLAG_MAC) != 0;
+			ctx->compress = (hdr.flags & HEADER_FLAG_COMPRESS) != 0;
+			memcpy(ctx->iv, hdr.iv, sizeof(ctx->iv));
+			memcpy(ctx->check, hdr.check, sizeof(ctx->check));
+			ctx->in_base = HEADER_SIZE;
+			*buffered = 0;
+			/* Every header has a key check, nothing in it can turn it off */
+			return header_verify(ctx, &hdr);
+
+		case -1:
+			fprintf(stderr, "%s: unsupported file format version or mode\n", ctx->infile);
+			return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,144 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "cipher.h"
+
+/*
+ * Telling the kernel what is coming: pipes made big enough to carry a
+ * block at a time, the output reserved in one go so it is laid out in
+ * one piece rather than grown a block at a time, the input read ahead,
+ * and the output written back steadily as it is written instead of
+ * piling up gigabytes of dirty pages that then all have to go out at
+ * once, stalling everything.
+ *
+ * All of it is advice, a file system or a file type that doesn't take it
+ * makes no difference to the result.
+ */
+
+/* Bytes of input read ahead up front */
+#define READAHEAD_SIZE (8 * 1024 * 1024)
+
+/*
+ * If file_des is a pipe makes room in it for size bytes, or as many as
+ * an unprivileged process may have
+ * A pipe starts out at 64K, which with a reader and a writer working
+ * through megabytes at a time has them taking turns on a few pages each
+ */
+static void pipe_grow(int file_des, size_t size)
+{
+	struct stat file_stat;
+	unsigned long max_size;
+	FILE *fp;
+
+	if (fstat(file_des, &file_stat) < 0 || !S_ISFIFO(file_stat.st_mode) ||
+		fcntl(file_des, F_SETPIPE_SZ, (int) size) >= 0 || errno != EPERM)
+	{
+		return;
+	}
+	if ((fp = fopen("/proc/sys/fs/pipe-max-size", "r")) != NULL)
+	{
+		if (fscanf(fp, "%lu", &max_size) == 1 && max_size < size)
+		{
+			fcntl(file_des, F_SETPIPE_SZ, (int) max_size);
+		}
+		fclose(fp);
+	}
+}
+
+/*
+ * Prepares the files of ctx for a run over all of the data
+ * Grows pipes to the block size. Reserves room for the output (it is
+ * only known up front for regular files), and unless direct is set,
+ * since direct I/O doesn't go through the page cache, asks for the input
+ * to be read ahead
+ * Returns 0 on success, or if space can't be reserved on this file
+ * system, otherwise prints the error and returns -1, e.g. if it doesn't
+ * fit on the disk
+ */
+int prepare_files(const struct crypt_ctx *ctx, int direct)
+{
+	struct stat infile_stat;
+	struct stat outfile_stat;
+	off_t size;
+
+	pipe_grow(ctx->infile_des, ctx->block_size);
+	pipe_grow(ctx->outfile_des, ctx->block_size);
+
+	if (fstat(ctx->infile_des, &infile_stat) < 0 ||
+		!(S_ISREG(infile_stat.st_mode) || S_ISBLK(infile_stat.st_mode)) ||
+		file_size(ctx->infile_des, &size) < 0)
+	{
+		return 0;
+	}
+	size = size > ctx->in_base ? size - ctx->in_base : 0;
+
+	if (!direct)
+	{
+		posix_fadvise(ctx->infile_des, 0, 0, POSIX_FADV_SEQUENTIAL);
+		readahead(ctx->infile_des, ctx->in_base, size < READAHEAD_SIZE ? size : READAHEAD_SIZE);
+	}
+
+	/* CBC encryption adds up to a block of padding, decryption removes it.
+	 * The size stays as it is, the writers set it. */
+	if (ctx->mode == MODE_CBC && ctx->enc)
+	{
+		size += 8;
+	}
+	if (size > 0 && fstat(ctx->outfile_des, &outfile_stat) == 0 && S_ISREG(outfile_stat.st_mode) &&
+		fallocate(ctx->outfile_des, FALLOC_FL_KEEP_SIZE, ctx->out_base, size) < 0 &&
+		errno == ENOSPC)
+	{
+		perror(ctx->outfile);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Starts write-behind on file_des from its current offset, if it is a
+ * regular file or a block device
+ */
+void wb_init(struct writebehind *wb, int file_des)
+{
+	struct stat file_stat;
+
+	wb->file_des = -1;
+	if (fstat(file_des, &file_stat) == 0 && (S_ISREG(file_stat.st_mode) || S_ISBLK(file_stat.st_mode)) &&
+		(wb->start = lseek(file_des, 0, SEEK_CUR)) >= 0)
+	{
+		wb->file_des = file_des;
+		wb->started = wb->start;
+		wb->written = wb->start;
+	}
+}
+
+/*
+ * Records that len more bytes have been written after the last ones
+ * Each time a window's worth has been written its writeback is started,
+ * and the window before is waited for, so at most two windows of the
+ * output are dirty at a time. The writer is held back to the speed of
+ * the disk as it goes rather than all at once at the end.
+ */
+void wb_advance(struct writebehind *wb, size_t len)
+{
+	if (wb->file_des < 0)
+	{
+		return;
+	}
+	wb->written += len;
+	while (wb->written - wb->started >= WB_WINDOW)
+	{
+		sync_file_range(wb->file_des, wb->started, WB_WINDOW, SYNC_FILE_RANGE_WRITE);
+		if (wb->started - wb->start >= WB_WINDOW)
+		{
+			sync_file_range(wb->file_des, wb->start, WB_WINDOW,
+				SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+			wb->start += WB_WINDOW;
+		}
+		wb->started += WB_WINDOW;
+	}
+}
@@ -0,0 +1,397 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "cipher.h"
+
+/*
+ * Encrypting or decrypting a file in place, a window at a time: each
+ * window is read, run through the stream and written back where it came
+ * from. Only headerless data can be done this way, everything else
+ * changes the length.
+ *
+ * Should the run be cut short, the file is part encrypted and part not,
+ * and without help there is no telling where one ends. So before a
+ * window is written back a journal records where it is, the state of the
+ * stream at its start and a copy of the window as it was, all synced
+ * before the window is touched, and the window is synced before the
+ * journal moves on. A rerun with the same options then finds the journal
+ * and does that window over from the copy, however much of it had made
+ * it to the disk, or in what pieces.
+ *
+ * The journal has two slots, written in turn, each with its own area for
+ * the copy, so one slot and its copy are always intact whenever the other
+ * is torn by a crash. The newer intact one counts. A slot:
+ *   0  "BFJOURNL"
+ *   8  sequence number
+ *  16  enc, mode, chunk size shift, zero
+ *  20  zero
+ *  24  size of the file
+ *  32  offset of the window
+ *  40  length of the window
+ *  48  salt, random for every journal
+ *  56  key check, the salt xored with "BFJRNLCK", encrypted
+ *  64  stream iv, ecount, num and pos at the start of the window
+ *  96  checksum of the copy of the window
+ * 104  IV of the data, from --iv or zero, that the sectors are keyed from
+ * 112  checksum of the slot up to here
+ * The slots are followed by the two areas of INPLACE_WINDOW bytes, the
+ * copy of slot n being in area n % 2. All numbers are 64 bit big endian.
+ */
+
+/* Bytes transformed at a time */
+#define INPLACE_WINDOW (16 * 1024 * 1024)
+
+#define JOURNAL_MAGIC "BFJOURNL"
+#define JOURNAL_SLOT 120
+
+struct journal
+{
+	int file_des;
+	uint64_t seq;
+	int enc;
+	int mode;
+	int chunk_shift;
+	off_t size;
+	off_t offset;
+	off_t len;
+	unsigned char salt[8];
+	unsigned char key_check[8];
+	unsigned char base_iv[8];
+	unsigned char iv[8];
+	unsigned char ecount[8];
+	int num;
+	off_t pos;
+	uint64_t copy_sum;
+};
+
+/*
+ * Checksum of len bytes, only meant to catch a torn or damaged write,
+ * not to stand up to anyone trying to fool it
+ */
+static uint64_t checksum(const unsigned char *buf, size_t len)
+{
+	uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+	uint64_t w;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8)
+	{
+		memcpy(&w, buf + i, 8);
+		h = (h ^ w) * 0x100000001b3ULL;
+		h ^= h >> 29;
+	}
+	for (; i < len; i++)
+	{
+		h = (h ^ buf[i]) * 0x100000001b3ULL;
+	}
+	return h ^ (h >> 32);
+}
+
+/*
+ * The salt of a journal xored with "BFJRNLCK", encrypted with key, so a
+ * journal is only resumed with the password it was written with. Like
+ * the key check of a header the salt makes it different for every
+ * journal, and the xor keeps it from being a block of the keystream of
+ * the data, which for headerless CFB starts with the zero block.
+ */
+static void key_check(BF_KEY *key, const unsigned char *salt, unsigned char *check)
+{
+	static const unsigned char tweak[8] = "BFJRNLCK";
+	int i;
+
+	for (i = 0; i < 8; i++)
+	{
+		check[i] = salt[i] ^ tweak[i];
+	}
+	BF_ecb_encrypt(check, check, key, BF_ENCRYPT);
+}
+
+/*
+ * Offset in the journal of the area for the copy of slot seq
+ */
+static off_t journal_area(uint64_t seq)
+{
+	return 2 * JOURNAL_SLOT + (off_t) (seq & 1) * INPLACE_WINDOW;
+}
+
+/*
+ * Writes copy, the jn->len bytes of the window as they are, and jn to its
+ * next slot, syncing each in turn so the slot is never there without its
+ * copy
+ * Returns 0 on success or -1 with errno set
+ */
+static int journal_write(struct journal *jn, const unsigned char *copy)
+{
+	unsigned char slot[JOURNAL_SLOT];
+
+	jn->copy_sum = checksum(copy, jn->len);
+	if (pwrite_full(jn->file_des, copy, jn->len, journal_area(jn->seq)) < 0 ||
+		fdatasync(jn->file_des) < 0)
+	{
+		return -1;
+	}
+
+	memset(slot, 0, sizeof(slot));
+	memcpy(slot, JOURNAL_MAGIC, 8);
+	put64(slot + 8, jn->seq);
+	slot[16] = (unsigned char) jn->enc;
+	slot[17] = (unsigned char) jn->mode;
+	slot[18] = (unsigned char) jn->chunk_shift;
+	put64(slot + 24, jn->size);
+	put64(slot + 32, jn->offset);
+	put64(slot + 40, jn->len);
+	memcpy(slot + 48, jn->salt, 8);
+	memcpy(slot + 56, jn->key_check, 8);
+	memcpy(slot + 64, jn->iv, 8);
+	memcpy(slot + 72, jn->ecount, 8);
+	put64(slot + 80, jn->num);
+	put64(slot + 88, jn->pos);
+	put64(slot + 96, jn->copy_sum);
+	memcpy(slot + 104, jn->base_iv, 8);
+	put64(slot + JOURNAL_SLOT - 8, checksum(slot, JOURNAL_SLOT - 8));
+
+	if (pwrite_full(jn->file_des, slot, JOURNAL_SLOT, (off_t) (jn->seq & 1) * JOURNAL_SLOT) < 0 ||
+		fdatasync(jn->file_des) < 0)
+	{
+		return -1;
+	}
+	jn->seq++;
+	return 0;
+}
+
+/*
+ * Reads the newest intact slot of the journal into jn
+ * Returns 1 if there is one, 0 if not, i.e. nothing had been written to
+ * the file yet, or -1 with errno set
+ */
+static int journal_read(struct journal *jn)
+{
+	unsigned char slot[JOURNAL_SLOT];
+	uint64_t best_seq = 0;
+	ssize_t got;
+	int found = 0;
+	int best = 0;
+	int k;
+
+	for (k = 0; k < 2; k++)
+	{
+		if ((got = pread_full(jn->file_des, slot, JOURNAL_SLOT, (off_t) k * JOURNAL_SLOT)) < 0)
+		{
+			return -1;
+		}
+		if (got == JOURNAL_SLOT && memcmp(slot, JOURNAL_MAGIC, 8) == 0 &&
+			get64(slot + JOURNAL_SLOT - 8) == checksum(slot, JOURNAL_SLOT - 8) &&
+			(!found || get64(slot + 8) > best_seq))
+		{
+			found = 1;
+			best = k;
+			best_seq = get64(slot + 8);
+		}
+	}
+	if (!found)
+	{
+		return 0;
+	}
+
+	if (pread_full(jn->file_des, slot, JOURNAL_SLOT, (off_t) best * JOURNAL_SLOT) != JOURNAL_SLOT)
+	{
+		errno = EIO;
+		return -1;
+	}
+	jn->seq = best_seq + 1;
+	jn->enc = slot[16];
+	jn->mode = slot[17];
+	jn->chunk_shift = slot[18];
+	jn->size = get64(slot + 24);
+	jn->offset = get64(slot + 32);
+	jn->len = get64(slot + 40);
+	memcpy(jn->salt, slot + 48, 8);
+	memcpy(jn->key_check, slot + 56, 8);
+	memcpy(jn->iv, slot + 64, 8);
+	memcpy(jn->ecount, slot + 72, 8);
+	jn->num = (int) get64(slot + 80);
+	jn->pos = get64(slot + 88);
+	jn->copy_sum = get64(slot + 96);
+	memcpy(jn->base_iv, slot + 104, 8);
+	return 1;
+}
+
+/*
+ * Does the window the journal in jn was interrupted in over from its
+ * copy, putting st where the window ends
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+static int inplace_resume(const struct crypt_ctx *ctx, struct stream *st, struct journal *jn,
+	unsigned char *buffer, const char *journal)
+{
+	size_t len = jn->len;
+
+	memcpy(st->iv, jn->iv, 8);
+	memcpy(st->ecount, jn->ecount, 8);
+	st->num = jn->num;
+	st->pos = jn->pos;
+
+	/* The slot is only written once its copy is on disk, a copy that
+	 * doesn't match was damaged since */
+	if (len > INPLACE_WINDOW ||
+		pread_full(jn->file_des, buffer, len, journal_area(jn->seq - 1)) != (ssize_t) len ||
+		checksum(buffer, len) != jn->copy_sum)
+	{
+		fprintf(stderr, "%s: damaged, %s can't be recovered from it\n", journal, ctx->infile);
+		return -1;
+	}
+	stream_crypt(st, buffer, buffer, len);
+	if (pwrite_full(ctx->outfile_des, buffer, len, jn->offset) < 0 || fdatasync(ctx->outfile_des) < 0)
+	{
+		perror(ctx->outfile);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The loop of crypt_inplace, from offset to the end of the file
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+static int inplace_loop(const struct crypt_ctx *ctx, struct stream *st, struct journal *jn,
+	unsigned char *buffer, const char *journal, off_t offset)
+{
+	ssize_t got;
+	size_t len;
+
+	for (; offset < jn->size; offset += len)
+	{
+		len = jn->size - offset < INPLACE_WINDOW ? jn->size - offset : INPLACE_WINDOW;
+		if ((got = pread_full(ctx->infile_des, buffer, len, offset)) != (ssize_t) len)
+		{
+			/* Shorter than it was a moment ago */
+			if (got >= 0)
+			{
+				errno = EIO;
+			}
+			perror(ctx->infile);
+			return -1;
+		}
+
+		jn->offset = offset;
+		jn->len = len;
+		memcpy(jn->iv, st->iv, 8);
+		memcpy(jn->ecount, st->ecount, 8);
+		jn->num = st->num;
+		jn->pos = st->pos;
+
+		/* The journal has to be on disk before any of the window is, and
+		 * the window before the journal moves past it */
+		if (journal_write(jn, buffer) < 0)
+		{
+			perror(journal);
+			return -1;
+		}
+		stream_crypt(st, buffer, buffer, len);
+		if (pwrite_full(ctx->outfile_des, buffer, len, offset) < 0 || fdatasync(ctx->outfile_des) < 0)
+		{
+			perror(ctx->outfile);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Encrypts or decrypts the headerless data of ctx->infile in place, with
+ * a crash journal at the path journal, resuming the run recorded there if
+ * there is one
+ * ctx->infile and ctx->outfile are the same, open for reading and writing
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+int crypt_inplace(const struct crypt_ctx *ctx, const char *journal)
+{
+	struct stat file_stat;
+	struct journal jn;
+	struct stream st;
+	struct arena arena;
+	unsigned char *buffer;
+	unsigned char check[8];
+	off_t offset = 0;
+	int found;
+	int ret;
+
+	memset(&jn, 0, sizeof(jn));
+	if (fstat(ctx->infile_des, &file_stat) < 0)
+	{
+		perror(ctx->infile);
+		return -1;
+	}
+	if ((jn.file_des = open(journal, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR)) < 0)
+	{
+		perror(journal);
+		return -1;
+	}
+	if ((found = journal_read(&jn)) < 0)
+	{
+		perror(journal);
+		close_file(journal, jn.file_des);
+		return -1;
+	}
+
+	/* A new journal gets a new salt */
+	if (!found && random_bytes(jn.salt, sizeof(jn.salt)) < 0)
+	{
+		perror("/dev/urandom");
+		close_file(journal, jn.file_des);
+		return -1;
+	}
+	key_check(ctx->key, jn.salt, check);
+	if (found && (jn.enc != ctx->enc || jn.mode != ctx->mode || jn.chunk_shift != ctx->chunk_shift ||
+		jn.size != file_stat.st_size || memcmp(jn.key_check, check, 8) != 0 ||
+		memcmp(jn.base_iv, ctx->iv, 8) != 0))
+	{
+		fprintf(stderr, "%s: left by an interrupted run with other options or another password, "
+			"rerun that to finish it\n", journal);
+		close_file(journal, jn.file_des);
+		return -1;
+	}
+	jn.enc = ctx->enc;
+	jn.mode = ctx->mode;
+	jn.chunk_shift = ctx->chunk_shift;
+	jn.size = file_stat.st_size;
+	memcpy(jn.key_check, check, 8);
+	memcpy(jn.base_iv, ctx->iv, 8);
+
+	if ((buffer = arena_alloc(&arena, INPLACE_WINDOW)) == NULL)
+	{
+		fprintf(stderr, "%s\n", strerror(errno));
+		close_file(journal, jn.file_des);
+		return -1;
+	}
+	stream_init(&st, ctx);
+
+	ret = 0;
+	if (found)
+	{
+		fprintf(stderr, "%s: resuming the interrupted run at byte %lld\n", ctx->infile,
+			(long long) jn.offset);
+		ret = inplace_resume(ctx, &st, &jn, buffer, journal);
+		offset = jn.offset + jn.len;
+	}
+	if (ret == 0)
+	{
+		ret = inplace_loop(ctx, &st, &jn, buffer, journal, offset);
+	}
+
+	close_file(journal, jn.file_des);
+	memset(&st, 0, sizeof(st));
+	memset(&jn, 0, sizeof(jn));
+	arena_free(&arena);
+	/* Done, nothing left to resume */
+	if (ret == 0 && unlink(journal) < 0)
+	{
+		perror(journal);
+	}
+	return ret;
+}
@@ -0,0 +1,153 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include "cipher.h"
+
+/*
+ * Producer thread: fills free slots of the ring with OFB keystream,
+ * which is just zeros run through BF_ofb64_encrypt, until stopped
+ * It is only used when chunks are a multiple of KS_SLOT_SIZE, so in a
+ * chunked file the keystream starts over at the start of a slot
+ */
+static void *ks_producer(void *arg)
+{
+	struct keystream *ks = arg;
+	unsigned char *slot;
+	off_t pos;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&ks->lock);
+		while (!ks->stop && ks->produced - ks->consumed == KS_SLOTS)
+		{
+			pthread_cond_wait(&ks->cond, &ks->lock);
+		}
+		if (ks->stop)
+		{
+			pthread_mutex_unlock(&ks->lock);
+			break;
+		}
+		slot = ks->ring + (ks->produced % KS_SLOTS) * KS_SLOT_SIZE;
+		pthread_mutex_unlock(&ks->lock);
+
+		/* Only this thread changes produced */
+		pos = (off_t) ks->produced * KS_SLOT_SIZE;
+		if (ks->chunk_shift != 0 && (pos & (((off_t) 1 << ks->chunk_shift) - 1)) == 0)
+		{
+			chunk_iv(ks->key, ks->base_iv, pos >> ks->chunk_shift, ks->iv);
+			ks->num = 0;
+		}
+		memset(slot, 0, KS_SLOT_SIZE);
+		BF_ofb64_encrypt(slot, slot, KS_SLOT_SIZE, ks->key, ks->iv, &ks->num);
+
+		pthread_mutex_lock(&ks->lock);
+		ks->produced++;
+		pthread_cond_broadcast(&ks->cond);
+		pthread_mutex_unlock(&ks->lock);
+	}
+	return NULL;
+}
+
+/*
+ * Starts making the OFB keystream for the data of ctx from its start
+ * Returns 0 on success or -1 with errno set, in which case the caller
+ * can still use BF_ofb64_encrypt directly
+ */
+int ks_start(struct keystream *ks, const struct crypt_ctx *ctx)
+{
+	int err;
+
+	memset(ks, 0, sizeof(*ks));
+	ks->key = ctx->key;
+	ks->chunk_shift = ctx->chunk_shift;
+	memcpy(ks->base_iv, ctx->iv, sizeof(ks->base_iv));
+	memcpy(ks->iv, ctx->iv, sizeof(ks->iv));
+	if ((ks->ring = malloc(KS_SLOTS * KS_SLOT_SIZE)) == NULL)
+	{
+		return -1;
+	}
+	pthread_mutex_init(&ks->lock, NULL);
+	pthread_cond_init(&ks->cond, NULL);
+	if ((err = pthread_create(&ks->thread, NULL, ks_producer, ks)) != 0)
+	{
+		pthread_cond_destroy(&ks->cond);
+		pthread_mutex_destroy(&ks->lock);
+		free(ks->ring);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * XORs the next len bytes of keystream into in, writing to out
+ * Only waits on the producer if it has fallen behind
+ */
+void ks_xor(struct keystream *ks, const unsigned char *in, unsigned char *out, size_t len)
+{
+	const unsigned char *key;
+	uint64_t a, b;
+	size_t n, i;
+
+	while (len > 0)
+	{
+		if (ks->pos == 0)
+		{
+			pthread_mutex_lock(&ks->lock);
+			while (ks->produced == ks->consumed)
+			{
+				pthread_cond_wait(&ks->cond, &ks->lock);
+			}
+			pthread_mutex_unlock(&ks->lock);
+		}
+
+		key = ks->ring + (ks->consumed % KS_SLOTS) * KS_SLOT_SIZE + ks->pos;
+		n = KS_SLOT_SIZE - ks->pos < len ? KS_SLOT_SIZE - ks->pos : len;
+		for (i = 0; i + 8 <= n; i += 8)
+		{
+			memcpy(&a, in + i, 8);
+			memcpy(&b, key + i, 8);
+			a ^= b;
+			memcpy(out + i, &a, 8);
+		}
+		for (; i < n; i++)
+		{
+			out[i] = in[i] ^ key[i];
+		}
+		in += n;
+		out += n;
+		len -= n;
+		ks->pos += n;
+
+		/* Hand the used slot back to the producer */
+		if (ks->pos == KS_SLOT_SIZE)
+		{
+			pthread_mutex_lock(&ks->lock);
+			ks->consumed++;
+			ks->pos = 0;
+			pthread_cond_broadcast(&ks->cond);
+			pthread_mutex_unlock(&ks->lock);
+		}
+	}
+}
+
+/*
+ * Stops the producer and wipes and frees the ring
+ */
+void ks_stop(struct keystream *ks)
+{
+	pthread_mutex_lock(&ks->lock);
+	ks->stop = 1;
+	pthread_cond_broadcast(&ks->cond);
+	pthread_mutex_unlock(&ks->lock);
+	pthread_join(ks->thread, NULL);
+
+	pthread_cond_destroy(&ks->cond);
+	pthread_mutex_destroy(&ks->lock);
+	memset(ks->ring, 0, KS_SLOTS * KS_SLOT_SIZE);
+	free(ks->ring);
+	memset(ks->iv, 0, sizeof(ks->iv));
+	memset(ks->base_iv, 0, sizeof(ks->base_iv));
+}
@@ -0,0 +1,635 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "cipher.h"
+
+/*
+ * Authenticated files: with --mac every chunk of a chunked file is
+ * followed by its tag, and the file ends with a root tag over all of the
+ * chunk tags:
+ *
+ *   header | chunk 0 | tag 0 | chunk 1 | tag 1 | ... | chunk n | tag n | root
+ *
+ * Every chunk but the last is full. The last one is always short, empty
+ * if the data is a whole number of chunks, so the data ends where a chunk
+ * falls short, even in a stream.
+ *
+ * The tags are SipHash-2-4 with 128 bit output over the chunk number,
+ * with MAC_LAST set for the last chunk, followed by the ciphertext of the
+ * chunk. The key is derived from the header key check, which covers the IV
+ * and the header fields, with the Blowfish key, see
+ * mac_key. A chunk that is changed, moved, swapped with one of another
+ * file or cut off at the end gets a tag that doesn't match, and so does a
+ * file that is cut short, as its last chunk isn't marked as the last.
+ * The root is the MAC of the chunk tags in order, under MAC_ROOT, a
+ * number no chunk has, so all of the file comes down to one tag.
+ *
+ * The tags are over the ciphertext, so a file can be checked without
+ * being decrypted, at the speed of the hash rather than of Blowfish.
+ * Decryption checks each chunk before any of its plaintext is written
+ * and stops at the first bad one; --verify only checks, across -j
+ * threads, and writes nothing.
+ */
+
+#define MAC_LAST ((uint64_t) 1 << 63)
+#define MAC_ROOT ((uint64_t) 1 << 62)
+
+/* SipHash state, len is the number of bytes taken in so far */
+struct sip
+{
+	uint64_t v[4];
+	uint64_t len;
+};
+
+/*
+ * State shared by the workers of mac_parallel
+ * next and the error fields are protected by lock
+ */
+struct mac_state
+{
+	const struct crypt_ctx *ctx;
+	uint64_t key[2];
+	int verify;		/* only check the tags, write nothing */
+	size_t chunk;		/* bytes per chunk */
+	off_t chunks;		/* number of chunks, the last one short */
+	size_t last_len;	/* bytes of data in the last chunk */
+	unsigned char *tags;	/* tag of every chunk, for the root */
+	off_t next;
+	int err;
+	const char *err_file;
+	off_t bad;		/* chunk that failed its tag, or -1 */
+	pthread_mutex_t lock;
+};
+
+/*
+ * Loads 8 bytes little endian from p, the byte order of SipHash
+ */
+static uint64_t load_le64(const unsigned char *p)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 7; i >= 0; i--)
+	{
+		v = (v << 8) | p[i];
+	}
+	return v;
+}
+
+#define ROTL64(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+/*
+ * Runs rounds SipRounds over v
+ */
+static void sip_rounds(uint64_t *v, int rounds)
+{
+	while (rounds-- > 0)
+	{
+		v[0] += v[1];
+		v[1] = ROTL64(v[1], 13);
+		v[1] ^= v[0];
+		v[0] = ROTL64(v[0], 32);
+		v[2] += v[3];
+		v[3] = ROTL64(v[3], 16);
+		v[3] ^= v[2];
+		v[0] += v[3];
+		v[3] = ROTL64(v[3], 21);
+		v[3] ^= v[0];
+		v[2] += v[1];
+		v[1] = ROTL64(v[1], 17);
+		v[1] ^= v[2];
+		v[2] = ROTL64(v[2], 32);
+	}
+}
+
+/*
+ * Takes in the word m
+ */
+static void sip_word(struct sip *s, uint64_t m)
+{
+	s->v[3] ^= m;
+	sip_rounds(s->v, 2);
+	s->v[0] ^= m;
+	s->len += 8;
+}
+
+/*
+ * Starts a 128 bit SipHash with key, of a message that begins with number
+ */
+static void sip_init(struct sip *s, const uint64_t *key, uint64_t number)
+{
+	s->v[0] = key[0] ^ 0x736f6d6570736575ULL;
+	s->v[1] = key[1] ^ 0x646f72616e646f6dULL ^ 0xee;
+	s->v[2] = key[0] ^ 0x6c7967656e657261ULL;
+	s->v[3] = key[1] ^ 0x7465646279746573ULL;
+	s->len = 0;
+	sip_word(s, number);
+}
+
+/*
+ * Takes in len bytes of data, a multiple of 8
+ */
+static void sip_update(struct sip *s, const unsigned char *data, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i += 8)
+	{
+		sip_word(s, load_le64(data + i));
+	}
+}
+
+/*
+ * Takes in the last len bytes of the message, any number, and puts the
+ * MAC_TAG_SIZE bytes of the hash in tag
+ */
+static void sip_final(struct sip *s, const unsigned char *data, size_t len, unsigned char *tag)
+{
+	size_t whole = len & ~(size_t) 7;
+	uint64_t b;
+	size_t i;
+
+	sip_update(s, data, whole);
+	b = (s->len + len - whole) << 56;
+	for (i = whole; i < len; i++)
+	{
+		b |= (uint64_t) data[i] << (8 * (i - whole));
+	}
+	sip_word(s, b);
+
+	s->v[2] ^= 0xee;
+	sip_rounds(s->v, 4);
+	put64(tag, s->v[0] ^ s->v[1] ^ s->v[2] ^ s->v[3]);
+	s->v[1] ^= 0xdd;
+	sip_rounds(s->v, 4);
+	put64(tag + 8, s->v[0] ^ s->v[1] ^ s->v[2] ^ s->v[3]);
+	memset(s, 0, sizeof(*s));
+}
+
+/*
+ * Puts the tag of chunk number n in tag, last says it is the last chunk
+ */
+static void mac_tag(const uint64_t *key, off_t n, int last, const unsigned char *data, size_t len,
+	unsigned char *tag)
+{
+	struct sip s;
+
+	sip_init(&s, key, (uint64_t) n | (last ? MAC_LAST : 0));
+	sip_final(&s, data, len, tag);
+}
+
+/*
+ * Derives the MAC key of the file of ctx: the key check of its header
+ * xored with two tweaks, encrypted. The check covers the IV and every
+ * field of the header (see header_check), so the key is different for
+ * every file, can only be worked out with the key, and tags made under
+ * one header don't verify under another.
+ */
+static void mac_key(const struct crypt_ctx *ctx, uint64_t *key)
+{
+	static const unsigned char tweaks[2][8] = { "BFMACKY0", "BFMACKY1" };
+	unsigned char block[8];
+	int i;
+	int j;
+
+	for (i = 0; i < 2; i++)
+	{
+		for (j = 0; j < 8; j++)
+		{
+			block[j] = ctx->check[j] ^ tweaks[i][j];
+		}
+		BF_ecb_encrypt(block, block, ctx->key, BF_ENCRYPT);
+		key[i] = get64(block);
+	}
+	memset(block, 0, sizeof(block));
+}
+
+/*
+ * Prints that chunk n of ctx->infile failed its tag
+ */
+static void mac_bad(const struct crypt_ctx *ctx, off_t n)
+{
+	fprintf(stderr, "%s: chunk %lld (at byte %lld) fails its MAC, the file is damaged or has been "
+		"tampered with\n", ctx->infile, (long long) n,
+		(long long) (ctx->in_base + n * (off_t) (((size_t) 1 << ctx->chunk_shift) + MAC_TAG_SIZE)));
+}
+
+/*
+ * Runs the file of ms->ctx through from front to back, for pipes or a
+ * single thread: encryption writes every chunk with its tag as soon as it
+ * is encrypted, decryption only writes a chunk once its tag has been
+ * checked
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+static int mac_serial(struct mac_state *ms)
+{
+	const struct crypt_ctx *ctx = ms->ctx;
+	size_t rec = ms->chunk + MAC_TAG_SIZE;
+	struct arena arena;
+	struct writebehind wb;
+	struct stream st;
+	struct sip root;
+	unsigned char tag[MAC_TAG_SIZE];
+	unsigned char *buffer;
+	ssize_t got;
+	size_t have = 0;
+	size_t len;
+	off_t n;
+	int last = 0;
+	int ret = 0;
+
+	/* A chunk with its tag, and the root or the next tag behind it */
+	if ((buffer = arena_alloc(&arena, rec + MAC_TAG_SIZE)) == NULL)
+	{
+		fprintf(stderr, "%s\n", strerror(errno));
+		return -1;
+	}
+	if (!ms->verify)
+	{
+		wb_init(&wb, ctx->outfile_des);
+	}
+	stream_init(&st, ctx);
+	sip_init(&root, ms->key, MAC_ROOT);
+
+	for (n = 0; !last; n++)
+	{
+		if (ctx->enc)
+		{
+			if ((got = read_full(ctx->infile_des, buffer, ms->chunk)) < 0)
+			{
+				perror(ctx->infile);
+				ret = -1;
+				break;
+			}
+			len = got;
+			last = len < ms->chunk;
+			stream_crypt(&st, buffer, buffer, len);
+			mac_tag(ms->key, n, last, buffer, len, buffer + len);
+			sip_update(&root, buffer + len, MAC_TAG_SIZE);
+			have = len + MAC_TAG_SIZE;
+			if (last)
+			{
+				sip_final(&root, NULL, 0, buffer + have);
+				have += MAC_TAG_SIZE;
+			}
+			if (write_full(ctx->outfile_des, buffer, have) < 0)
+			{
+				perror(ctx->outfile);
+				ret = -1;
+				break;
+			}
+			wb_advance(&wb, have);
+			continue;
+		}
+
+		/* Only a record that falls short of a full chunk, its tag and the
+		 * next tag is the last, a full one may have the root behind it */
+		if ((got = read_full(ctx->infile_des, buffer + have, rec + MAC_TAG_SIZE - have)) < 0)
+		{
+			perror(ctx->infile);
+			ret = -1;
+			break;
+		}
+		have += got;
+		last = have < rec + MAC_TAG_SIZE;
+		if (last && have < 2 * MAC_TAG_SIZE)
+		{
+			fprintf(stderr, "%s: cut short, its MACs are missing\n", ctx->infile);
+			ret = -1;
+			break;
+		}
+		len = last ? have - 2 * MAC_TAG_SIZE : ms->chunk;
+		mac_tag(ms->key, n, last, buffer, len, tag);
+		if (memcmp(tag, buffer + len, MAC_TAG_SIZE) != 0)
+		{
+			mac_bad(ctx, n);
+			ret = -1;
+			break;
+		}
+		sip_update(&root, tag, MAC_TAG_SIZE);
+		if (last)
+		{
+			sip_final(&root, NULL, 0, tag);
+			if (memcmp(tag, buffer + len + MAC_TAG_SIZE, MAC_TAG_SIZE) != 0)
+			{
+				fprintf(stderr, "%s: the root MAC doesn't match its chunks\n", ctx->infile);
+				ret = -1;
+				break;
+			}
+		}
+		if (!ms->verify)
+		{
+			stream_crypt(&st, buffer, buffer, len);
+			if (write_full(ctx->outfile_des, buffer, len) < 0)
+			{
+				perror(ctx->outfile);
+				ret = -1;
+				break;
+			}
+			wb_advance(&wb, len);
+		}
+		if (!last)
+		{
+			memmove(buffer, buffer + rec, MAC_TAG_SIZE);
+			have = MAC_TAG_SIZE;
+		}
+	}
+
+	memset(&root, 0, sizeof(root));
+	memset(&st, 0, sizeof(st));
+	arena_free(&arena);
+	return ret;
+}
+
+/*
+ * Records the first error hit by any worker, err an errno value or 0 if
+ * chunk bad failed its tag; the rest stop after their chunk
+ */
+static void mac_fail(struct mac_state *ms, const char *file, int err, off_t bad)
+{
+	pthread_mutex_lock(&ms->lock);
+	if (ms->err == 0 && ms->bad < 0)
+	{
+		ms->err = err;
+		ms->err_file = file;
+		ms->bad = bad;
+	}
+	pthread_mutex_unlock(&ms->lock);
+}
+
+/*
+ * Does chunk n of the file with buffer, which holds a chunk and its tag
+ * Returns 0 on success, otherwise records the error and returns -1
+ */
+static int mac_chunk(struct mac_state *ms, off_t n, unsigned char *buffer)
+{
+	const struct crypt_ctx *ctx = ms->ctx;
+	off_t rec = ms->chunk + MAC_TAG_SIZE;
+	size_t len = n == ms->chunks - 1 ? ms->last_len : ms->chunk;
+	size_t want = ctx->enc ? len : len + MAC_TAG_SIZE;
+	off_t in_offset = ctx->in_base + n * (ctx->enc ? (off_t) ms->chunk : rec);
+	unsigned char *tag = ms->tags + n * MAC_TAG_SIZE;
+	struct stream st;
+	ssize_t got;
+	int ret = 0;
+
+	if ((got = pread_full(ctx->infile_des, buffer, want, in_offset)) < 0 || (size_t) got != want)
+	{
+		/* The file shrank under us */
+		mac_fail(ms, ctx->infile, got < 0 ? errno : EIO, -1);
+		return -1;
+	}
+
+	if (!ctx->enc)
+	{
+		mac_tag(ms->key, n, n == ms->chunks - 1, buffer, len, tag);
+		if (memcmp(tag, buffer + len, MAC_TAG_SIZE) != 0)
+		{
+			mac_fail(ms, ctx->infile, 0, n);
+			return -1;
+		}
+		if (ms->verify)
+		{
+			return 0;
+		}
+	}
+
+	stream_init(&st, ctx);
+	if (stream_seek(&st, ctx, n * (off_t) ms->chunk) < 0)
+	{
+		mac_fail(ms, ctx->infile, errno, -1);
+		return -1;
+	}
+	stream_crypt(&st, buffer, buffer, len);
+	memset(&st, 0, sizeof(st));
+
+	if (ctx->enc)
+	{
+		mac_tag(ms->key, n, n == ms->chunks - 1, buffer, len, tag);
+		memcpy(buffer + len, tag, MAC_TAG_SIZE);
+		if (pwrite_full(ctx->outfile_des, buffer, len + MAC_TAG_SIZE, ctx->out_base + n * rec) < 0)
+		{
+			ret = -1;
+		}
+	}
+	else if (pwrite_full(ctx->outfile_des, buffer, len, ctx->out_base + n * (off_t) ms->chunk) < 0)
+	{
+		ret = -1;
+	}
+	if (ret < 0)
+	{
+		mac_fail(ms, ctx->outfile, errno, -1);
+	}
+	return ret;
+}
+
+/*
+ * Worker thread: takes chunks off the shared counter until the file is done
+ */
+static void *mac_worker(void *arg)
+{
+	struct mac_state *ms = arg;
+	struct arena arena;
+	unsigned char *buffer = arena_alloc(&arena, ms->chunk + MAC_TAG_SIZE);
+	off_t n;
+
+	if (buffer == NULL)
+	{
+		mac_fail(ms, ms->ctx->infile, errno, -1);
+		return NULL;
+	}
+
+	for (;;)
+	{
+		pthread_mutex_lock(&ms->lock);
+		n = ms->next++;
+		if (ms->err != 0 || ms->bad >= 0)
+		{
+			n = ms->chunks;
+		}
+		pthread_mutex_unlock(&ms->lock);
+
+		if (n >= ms->chunks || mac_chunk(ms, n, buffer) < 0)
+		{
+			break;
+		}
+	}
+
+	arena_free(&arena);
+	return NULL;
+}
+
+/*
+ * Works out from the size of infile where the chunks of ms are
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+static int mac_layout(struct mac_state *ms)
+{
+	const struct crypt_ctx *ctx = ms->ctx;
+	off_t rec = ms->chunk + MAC_TAG_SIZE;
+	off_t size;
+
+	if (file_size(ctx->infile_des, &size) < 0)
+	{
+		perror(ctx->infile);
+		return -1;
+	}
+	size = size > ctx->in_base ? size - ctx->in_base : 0;
+
+	if (ctx->enc)
+	{
+		ms->chunks = size / ms->chunk + 1;
+		ms->last_len = size % ms->chunk;
+		return 0;
+	}
+
+	/* Full chunks with their tags, then a short one with its tag and the root */
+	size -= 2 * MAC_TAG_SIZE;
+	if (size < 0 || size % rec >= (off_t) ms->chunk)
+	{
+		fprintf(stderr, "%s: cut short, its MACs are missing\n", ctx->infile);
+		return -1;
+	}
+	ms->chunks = size / rec + 1;
+	ms->last_len = size % rec;
+	return 0;
+}
+
+/*
+ * Does all of the chunks of ms in jobs worker threads, then the root
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+static int mac_parallel(struct mac_state *ms, int jobs)
+{
+	const struct crypt_ctx *ctx = ms->ctx;
+	off_t root_offset;
+	unsigned char root[MAC_TAG_SIZE];
+	unsigned char stored[MAC_TAG_SIZE];
+	struct sip s;
+	pthread_t *threads;
+	ssize_t got;
+	int started;
+	int i;
+
+	if (mac_layout(ms) < 0)
+	{
+		return -1;
+	}
+	if (jobs > ms->chunks)
+	{
+		jobs = ms->chunks;
+	}
+	if ((ms->tags = malloc(ms->chunks * MAC_TAG_SIZE)) == NULL ||
+		(threads = malloc(sizeof(pthread_t) * jobs)) == NULL)
+	{
+		fprintf(stderr, "%s\n", strerror(errno));
+		free(ms->tags);
+		return -1;
+	}
+
+	for (started = 0; started < jobs; started++)
+	{
+		int err = pthread_create(&threads[started], NULL, mac_worker, ms);
+		if (err != 0)
+		{
+			mac_fail(ms, ctx->infile, err, -1);
+			break;
+		}
+	}
+	for (i = 0; i < started; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+
+	if (ms->bad >= 0)
+	{
+		mac_bad(ctx, ms->bad);
+		free(ms->tags);
+		return -1;
+	}
+	if (ms->err != 0)
+	{
+		fprintf(stderr, "%s: %s\n", ms->err_file, strerror(ms->err));
+		free(ms->tags);
+		return -1;
+	}
+
+	/* The root goes after the tag of the last chunk */
+	sip_init(&s, ms->key, MAC_ROOT);
+	sip_final(&s, ms->tags, ms->chunks * MAC_TAG_SIZE, root);
+	free(ms->tags);
+	root_offset = (ms->chunks - 1) * (off_t) (ms->chunk + MAC_TAG_SIZE) + ms->last_len + MAC_TAG_SIZE;
+	if (ctx->enc)
+	{
+		if (pwrite_full(ctx->outfile_des, root, MAC_TAG_SIZE, ctx->out_base + root_offset) < 0)
+		{
+			perror(ctx->outfile);
+			return -1;
+		}
+		return 0;
+	}
+	if ((got = pread_full(ctx->infile_des, stored, MAC_TAG_SIZE, ctx->in_base + root_offset)) < 0 ||
+		(size_t) got != MAC_TAG_SIZE)
+	{
+		perror(ctx->infile);
+		return -1;
+	}
+	if (memcmp(root, stored, MAC_TAG_SIZE) != 0)
+	{
+		fprintf(stderr, "%s: the root MAC doesn't match its chunks\n", ctx->infile);
+		return -1;
+	}
+	/* The chunks were written in any order, the last one may not even have
+	 * any data */
+	if (!ms->verify && ftruncate(ctx->outfile_des,
+		ctx->out_base + (ms->chunks - 1) * (off_t) ms->chunk + ms->last_len) < 0)
+	{
+		perror(ctx->outfile);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Runs the data of ctx, a file with MACs (see above), through the cipher,
+ * in jobs threads if both files are regular files, or with verify set
+ * only checks the tags of infile and writes nothing
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+int crypt_mac(const struct crypt_ctx *ctx, int jobs, int verify)
+{
+	struct mac_state ms;
+	struct stat infile_stat;
+	struct stat outfile_stat;
+	int ret;
+
+	memset(&ms, 0, sizeof(ms));
+	ms.ctx = ctx;
+	ms.verify = verify;
+	ms.chunk = (size_t) 1 << ctx->chunk_shift;
+	ms.bad = -1;
+	mac_key(ctx, ms.key);
+	pthread_mutex_init(&ms.lock, NULL);
+
+	if (jobs > 1 && fstat(ctx->infile_des, &infile_stat) == 0 && S_ISREG(infile_stat.st_mode) &&
+		(verify || (fstat(ctx->outfile_des, &outfile_stat) == 0 && S_ISREG(outfile_stat.st_mode))))
+	{
+		ret = mac_parallel(&ms, jobs);
+	}
+	else
+	{
+		ret = mac_serial(&ms);
+	}
+
+	pthread_mutex_destroy(&ms.lock);
+	memset(&ms, 0, sizeof(ms));
+	return ret;
+}
@@ -0,0 +1,122 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cipher.h"
+
+/*
+ * The serial path on mmap: both files are mapped a window at a time and
+ * the cipher reads from one mapping and writes straight into the other,
+ * so there are no copies through buffers and no read/write calls at all.
+ * Files larger than a window are remapped as the run goes along, which
+ * keeps the address space and page tables used small.
+ */
+
+/* Bytes of data mapped at a time, a multiple of the page size */
+#define MAP_WINDOW (64 * 1024 * 1024)
+
+/*
+ * Maps len bytes at offset of file_des, which need not be page aligned
+ * *base and *base_len get what to munmap, the data starts at the return
+ * Returns NULL with errno set on failure
+ */
+static unsigned char *map_window(int file_des, off_t offset, size_t len, int prot,
+	void **base, size_t *base_len)
+{
+	off_t page = sysconf(_SC_PAGESIZE);
+	off_t delta = offset % page;
+
+	*base_len = len + delta;
+	*base = mmap(NULL, *base_len, prot, MAP_SHARED, file_des, offset - delta);
+	if (*base == MAP_FAILED)
+	{
+		return NULL;
+	}
+	/* Hints only, the kernel is free to ignore them */
+	madvise(*base, *base_len, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+	madvise(*base, *base_len, MADV_HUGEPAGE);
+#endif
+	return (unsigned char *) *base + delta;
+}
+
+/*
+ * Runs the rest of ctx->infile through st onto ctx->outfile through mmap
+ * Both have to be regular files; the data starts at their current offsets
+ * and outfile is cut or extended to fit
+ * Returns 0 on success, 1 if mmap can't be used for these files, in which
+ * case nothing has been read or written, otherwise prints the error and
+ * returns -1
+ */
+int crypt_mmap(const struct crypt_ctx *ctx, struct stream *st)
+{
+	struct stat infile_stat;
+	struct stat outfile_stat;
+	off_t in_start;
+	off_t out_start;
+	off_t size;
+	off_t offset;
+	size_t len;
+	unsigned char *in;
+	unsigned char *out;
+	void *in_base;
+	void *out_base;
+	size_t in_len;
+	size_t out_len;
+	struct writebehind wb;
+
+	if (fstat(ctx->infile_des, &infile_stat) < 0 || fstat(ctx->outfile_des, &outfile_stat) < 0 ||
+		!S_ISREG(infile_stat.st_mode) || !S_ISREG(outfile_stat.st_mode) ||
+		(in_start = lseek(ctx->infile_des, 0, SEEK_CUR)) < 0 ||
+		(out_start = lseek(ctx->outfile_des, 0, SEEK_CUR)) < 0)
+	{
+		return 1;
+	}
+	size = infile_stat.st_size > in_start ? infile_stat.st_size - in_start : 0;
+
+	/* Writing to a mapping past the end of the file is a SIGBUS, and so is
+	 * running out of space, so size the file and reserve the blocks first.
+	 * Not every file system can reserve. */
+	if (ftruncate(ctx->outfile_des, out_start + size) < 0)
+	{
+		perror(ctx->outfile);
+		return -1;
+	}
+	if (size > 0 && fallocate(ctx->outfile_des, 0, out_start, size) < 0 &&
+		errno != EOPNOTSUPP && errno != ENOSYS)
+	{
+		perror(ctx->outfile);
+		return -1;
+	}
+
+	/* Pages dirtied through the mapping are written back like any others */
+	wb_init(&wb, ctx->outfile_des);
+	for (offset = 0; offset < size; offset += len)
+	{
+		len = size - offset < MAP_WINDOW ? size - offset : MAP_WINDOW;
+		if ((in = map_window(ctx->infile_des, in_start + offset, len, PROT_READ,
+			&in_base, &in_len)) == NULL)
+		{
+			perror(ctx->infile);
+			return -1;
+		}
+		if ((out = map_window(ctx->outfile_des, out_start + offset, len, PROT_READ | PROT_WRITE,
+			&out_base, &out_len)) == NULL)
+		{
+			perror(ctx->outfile);
+			munmap(in_base, in_len);
+			return -1;
+		}
+
+		stream_crypt(st, in, out, len);
+
+		munmap(in_base, in_len);
+		munmap(out_base, out_len);
+		wb_advance(&wb, len);
+	}
+	return 0;
+}
@@ -0,0 +1,326 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include "cipher.h"
+
+/*
+ * State shared by the workers
+ * next and the error fields are protected by lock
+ */
+struct par_state
+{
+	const struct crypt_ctx *ctx;
+	off_t size;
+	size_t segment;		/* bytes taken at a time: the block size, in whole chunks */
+	off_t next;
+	int err;
+	const char *err_file;
+	pthread_mutex_t lock;
+};
+
+/*
+ * Records the first error hit by any worker, the rest stop after their segment
+ */
+static void par_fail(struct par_state *ps, const char *file, int err)
+{
+	pthread_mutex_lock(&ps->lock);
+	if (ps->err == 0)
+	{
+		ps->err = err;
+		ps->err_file = file;
+	}
+	pthread_mutex_unlock(&ps->lock);
+}
+
+/*
+ * Reads up to len bytes at the current position, retrying short reads
+ * Returns the number of bytes read, less than len only at end of file, or -1
+ */
+ssize_t read_full(int fd, unsigned char *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len)
+	{
+		if ((ret = read(fd, buf + done, len - done)) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		if (ret == 0)
+		{
+			break;
+		}
+		done += ret;
+	}
+	return done;
+}
+
+/*
+ * Reads len bytes at offset, retrying short reads
+ * Returns the number of bytes read, less than len only at end of file, or -1
+ */
+ssize_t pread_full(int fd, unsigned char *buf, size_t len, off_t offset)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len)
+	{
+		if ((ret = pread(fd, buf + done, len - done, offset + done)) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		if (ret == 0)
+		{
+			break;
+		}
+		done += ret;
+	}
+	return done;
+}
+
+/*
+ * Writes len bytes at offset, retrying short writes
+ * Returns 0 on success or -1
+ */
+int pwrite_full(int fd, const unsigned char *buf, size_t len, off_t offset)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len)
+	{
+		if ((ret = pwrite(fd, buf + done, len - done, offset + done)) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		done += ret;
+	}
+	return 0;
+}
+
+/*
+ * Gets the size of fd, a regular file or a block device, for which fstat
+ * has no size
+ * Returns 0 on success or -1 with errno set
+ */
+int file_size(int fd, off_t *size)
+{
+	struct stat file_stat;
+	uint64_t bytes;
+
+	if (fstat(fd, &file_stat) < 0)
+	{
+		return -1;
+	}
+	if (S_ISBLK(file_stat.st_mode))
+	{
+		if (ioctl(fd, BLKGETSIZE64, &bytes) < 0)
+		{
+			return -1;
+		}
+		*size = (off_t) bytes;
+		return 0;
+	}
+	*size = file_stat.st_size;
+	return 0;
+}
+
+/*
+ * Writes len bytes at the current position, retrying short writes
+ * Returns 0 on success or -1
+ */
+int write_full(int fd, const unsigned char *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len)
+	{
+		if ((ret = write(fd, buf + done, len - done)) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		done += ret;
+	}
+	return 0;
+}
+
+/*
+ * Worker thread: takes segments off the shared counter until the file is done
+ * Segments are independent: CTR can start anywhere, in CFB or CBC decryption
+ * a segment starting on a block boundary only needs the 8 bytes of
+ * ciphertext in front of it as its IV, and chunks of a chunked file start
+ * over with their own IV whatever the mode
+ */
+static void *par_worker(void *arg)
+{
+	struct par_state *ps = arg;
+	const struct crypt_ctx *ctx = ps->ctx;
+	struct arena arena;
+	unsigned char *buffer = arena_alloc(&arena, ps->segment);
+	struct stream st;
+	off_t offset;
+	ssize_t bytes_read;
+	size_t want;
+
+	if (buffer == NULL)
+	{
+		par_fail(ps, ctx->outfile, errno);
+		return NULL;
+	}
+
+	for (;;)
+	{
+		pthread_mutex_lock(&ps->lock);
+		offset = ps->next;
+		ps->next += ps->segment;
+		if (ps->err != 0)
+		{
+			offset = ps->size;
+		}
+		pthread_mutex_unlock(&ps->lock);
+
+		if (offset >= ps->size)
+		{
+			break;
+		}
+
+		want = ps->size - offset < (off_t) ps->segment ? ps->size - offset : ps->segment;
+		stream_init(&st, ctx);
+		if (stream_seek(&st, ctx, offset) < 0)
+		{
+			par_fail(ps, ctx->infile, errno);
+			break;
+		}
+		if ((bytes_read = pread_full(ctx->infile_des, buffer, want, ctx->in_base + offset)) < 0)
+		{
+			par_fail(ps, ctx->infile, errno);
+			break;
+		}
+		/* The file shrank under us */
+		if ((size_t) bytes_read != want)
+		{
+			par_fail(ps, ctx->infile, EIO);
+			break;
+		}
+
+		stream_crypt(&st, buffer, buffer, want);
+
+		if (pwrite_full(ctx->outfile_des, buffer, want, ctx->out_base + offset) < 0)
+		{
+			par_fail(ps, ctx->outfile, errno);
+			break;
+		}
+		/* Segments finish in any order, so rather than wb_advance just get
+		 * each on its way to the disk */
+		sync_file_range(ctx->outfile_des, ctx->out_base + offset, want, SYNC_FILE_RANGE_WRITE);
+	}
+
+	memset(&st, 0, sizeof(st));
+	arena_free(&arena);
+	return NULL;
+}
+
+/*
+ * Runs the data of ctx through the cipher using jobs worker threads
+ * Both files must be regular files or block devices. Unless the mode is
+ * CTR or the file is chunked this can only decrypt, and not OFB. The
+ * output is identical to the serial path.
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+int crypt_parallel(const struct crypt_ctx *ctx, int jobs)
+{
+	struct par_state ps;
+	off_t size;
+	size_t chunk;
+	pthread_t *threads;
+	int started;
+	int i;
+
+	if (file_size(ctx->infile_des, &size) < 0)
+	{
+		perror(ctx->infile);
+		return -1;
+	}
+
+	memset(&ps, 0, sizeof(ps));
+	ps.ctx = ctx;
+	ps.size = size > ctx->in_base ? size - ctx->in_base : 0;
+	/* Chunks can be small (sectors), a segment is as many whole ones as
+	 * make up a block */
+	ps.segment = ctx->block_size;
+	if (ctx->chunk_shift != 0)
+	{
+		chunk = (size_t) 1 << ctx->chunk_shift;
+		ps.segment = (ps.segment + chunk - 1) & ~(chunk - 1);
+	}
+	pthread_mutex_init(&ps.lock, NULL);
+
+	/* No point starting more threads than there are segments */
+	if (jobs > (ps.size + (off_t) ps.segment - 1) / (off_t) ps.segment)
+	{
+		jobs = (ps.size + (off_t) ps.segment - 1) / (off_t) ps.segment;
+	}
+	if (jobs < 1)
+	{
+		jobs = 1;
+	}
+
+	if ((threads = malloc(sizeof(pthread_t) * jobs)) == NULL)
+	{
+		fprintf(stderr, "%s\n", strerror(errno));
+		pthread_mutex_destroy(&ps.lock);
+		return -1;
+	}
+
+	for (started = 0; started < jobs; started++)
+	{
+		int err = pthread_create(&threads[started], NULL, par_worker, &ps);
+		if (err != 0)
+		{
+			par_fail(&ps, ctx->outfile, err);
+			break;
+		}
+	}
+	for (i = 0; i < started; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+
+	free(threads);
+	pthread_mutex_destroy(&ps.lock);
+
+	if (ps.err != 0)
+	{
+		fprintf(stderr, "%s: %s\n", ps.err_file, strerror(ps.err));
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,347 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "cipher.h"
+
+/*
+ * The serial path as three stages, each in its own thread: the reader
+ * fills slots, the cipher runs them through the stream in place and the
+ * writer writes them out, after which the reader can fill them again.
+ * So reading, encrypting and writing overlap and a run takes about as
+ * long as the slowest of them instead of all three added up.
+ *
+ * Slot i of the data lives in slots[i % PIPE_SLOTS]. Each stage counts
+ * the slots it is done with; only that stage changes its counter, the
+ * next one reads it, so the ring needs no lock. A slot read with no data
+ * means end of file and is passed down the stages like any other.
+ *
+ * When the output is a pipe the writer hands it the pages of each slot
+ * with vmsplice instead of copying them in with write. The pipe then
+ * holds on to those pages until they are read, and possibly longer if
+ * whatever reads it splices them on, so the slot can't be filled again
+ * in them: its pages are dropped instead, and the next read into the
+ * slot gets fresh ones.
+ */
+
+/* Number of slots, each is ctx->block_size bytes of one arena */
+#define PIPE_SLOTS 4
+
+struct pipe_slot
+{
+	unsigned char *buf;
+	size_t len;
+};
+
+struct pipeline
+{
+	const struct crypt_ctx *ctx;
+	struct stream *st;
+	struct arena arena;
+	struct pipe_slot slots[PIPE_SLOTS];
+	atomic_uint read_count;
+	atomic_uint crypt_count;
+	atomic_uint write_count;
+	/* bumped whenever anything above changes, the futex stages sleep on */
+	atomic_uint seq;
+	atomic_int err;
+	const char *err_file;
+};
+
+/*
+ * Wakes any stage waiting for the pipeline to change
+ */
+static void pipe_wake(struct pipeline *pl)
+{
+	atomic_fetch_add_explicit(&pl->seq, 1, memory_order_release);
+	syscall(SYS_futex, &pl->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/*
+ * Records count as done for a stage and lets the others know
+ */
+static void pipe_publish(struct pipeline *pl, atomic_uint *counter, unsigned int count)
+{
+	atomic_store_explicit(counter, count, memory_order_release);
+	pipe_wake(pl);
+}
+
+/*
+ * Stops the pipeline, keeping only the first error
+ */
+static void pipe_fail(struct pipeline *pl, const char *file, int err)
+{
+	int none = 0;
+
+	if (atomic_compare_exchange_strong(&pl->err, &none, err))
+	{
+		pl->err_file = file;
+	}
+	pipe_wake(pl);
+}
+
+/*
+ * Sleeps until *counter - base reaches at least need (the counters wrap,
+ * hence the difference) or the pipeline is stopped
+ * Returns 0, or -1 if stopped
+ */
+static int pipe_wait(struct pipeline *pl, atomic_uint *counter, unsigned int base, unsigned int need)
+{
+	unsigned int seq;
+
+	for (;;)
+	{
+		/* Anything that changes after seq is read bumps it, so the futex
+		 * won't sleep through it */
+		seq = atomic_load_explicit(&pl->seq, memory_order_acquire);
+		if (atomic_load(&pl->err) != 0)
+		{
+			return -1;
+		}
+		if (atomic_load_explicit(counter, memory_order_acquire) - base >= need)
+		{
+			return 0;
+		}
+		syscall(SYS_futex, &pl->seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+	}
+}
+
+/*
+ * Checks whether the writer can vmsplice slots into ctx->outfile and then
+ * drop their pages, which works for a pipe and memory that madvise can
+ * drop pages from, which isn't true of all huge pages
+ */
+static int pipe_can_splice(const struct crypt_ctx *ctx, struct pipeline *pl)
+{
+	struct stat file_stat;
+
+	return fstat(ctx->outfile_des, &file_stat) == 0 && S_ISFIFO(file_stat.st_mode) &&
+		madvise(pl->arena.base, pl->arena.len, MADV_DONTNEED) == 0;
+}
+
+/*
+ * Gives the len bytes at buf to the pipe file_des, then drops the pages
+ * of the slot_size bytes of the slot at buf
+ * Returns 0 on success, 1 if vmsplice isn't allowed here and nothing was
+ * done, or -1 with errno set
+ */
+static int pipe_splice(int file_des, unsigned char *buf, size_t len, size_t slot_size)
+{
+	struct iovec iov;
+	ssize_t n;
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	while (iov.iov_len > 0)
+	{
+		if ((n = vmsplice(file_des, &iov, 1, SPLICE_F_GIFT)) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			/* e.g. a seccomp filter, which will have stopped the first one */
+			if ((errno == ENOSYS || errno == EPERM) && iov.iov_len == len)
+			{
+				return 1;
+			}
+			return -1;
+		}
+		iov.iov_base = (unsigned char *) iov.iov_base + n;
+		iov.iov_len -= n;
+	}
+	/* Already checked to work */
+	madvise(buf, slot_size, MADV_DONTNEED);
+	return 0;
+}
+
+/*
+ * Reader stage: fills each slot once the writer is done with it
+ */
+static void *pipe_reader(void *arg)
+{
+	struct pipeline *pl = arg;
+	struct pipe_slot *slot;
+	unsigned int i;
+	ssize_t bytes_read;
+
+	for (i = 0; ; i++)
+	{
+		/* slot i is free once slot i - PIPE_SLOTS has been written */
+		if (pipe_wait(pl, &pl->write_count, i - PIPE_SLOTS, 1) < 0)
+		{
+			break;
+		}
+		slot = &pl->slots[i % PIPE_SLOTS];
+		while ((bytes_read = read(pl->ctx->infile_des, slot->buf, pl->ctx->block_size)) < 0 && errno == EINTR)
+		{
+		}
+		if (bytes_read < 0)
+		{
+			pipe_fail(pl, pl->ctx->infile, errno);
+			break;
+		}
+		slot->len = bytes_read;
+		pipe_publish(pl, &pl->read_count, i + 1);
+		if (bytes_read == 0)
+		{
+			break;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Cipher stage: runs each slot through the stream in place
+ */
+static void *pipe_cipher(void *arg)
+{
+	struct pipeline *pl = arg;
+	struct pipe_slot *slot;
+	unsigned int i;
+	size_t len;
+
+	for (i = 0; ; i++)
+	{
+		if (pipe_wait(pl, &pl->read_count, i, 1) < 0)
+		{
+			break;
+		}
+		slot = &pl->slots[i % PIPE_SLOTS];
+		/* Once published the slot can be written and filled again */
+		len = slot->len;
+		stream_crypt(pl->st, slot->buf, slot->buf, len);
+		pipe_publish(pl, &pl->crypt_count, i + 1);
+		if (len == 0)
+		{
+			break;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Runs the rest of ctx->infile through st onto ctx->outfile with a reader
+ * and a cipher thread, the calling thread doing the writing
+ * Works on pipes as well as files
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+int crypt_pipeline(const struct crypt_ctx *ctx, struct stream *st)
+{
+	struct pipeline pl;
+	struct pipe_slot *slot;
+	struct writebehind wb;
+	size_t len;
+	int splice = 0;
+	int ret;
+	pthread_t reader;
+	pthread_t cipher;
+	int started = 0;
+	unsigned int i;
+	int err;
+
+	memset(&pl, 0, sizeof(pl));
+	pl.ctx = ctx;
+	pl.st = st;
+	atomic_init(&pl.read_count, 0);
+	atomic_init(&pl.crypt_count, 0);
+	atomic_init(&pl.write_count, 0);
+	atomic_init(&pl.seq, 0);
+	atomic_init(&pl.err, 0);
+
+	if (arena_alloc(&pl.arena, PIPE_SLOTS * ctx->block_size) == NULL)
+	{
+		pipe_fail(&pl, ctx->outfile, errno);
+	}
+	for (i = 0; pl.arena.base != NULL && i < PIPE_SLOTS; i++)
+	{
+		pl.slots[i].buf = pl.arena.base + i * ctx->block_size;
+	}
+	/* Before the reader starts putting anything in the slots */
+	if (pl.arena.base != NULL)
+	{
+		splice = pipe_can_splice(ctx, &pl);
+	}
+
+	if (atomic_load(&pl.err) == 0)
+	{
+		if ((err = pthread_create(&reader, NULL, pipe_reader, &pl)) != 0)
+		{
+			pipe_fail(&pl, ctx->outfile, err);
+		}
+		else
+		{
+			++started;
+			if ((err = pthread_create(&cipher, NULL, pipe_cipher, &pl)) != 0)
+			{
+				pipe_fail(&pl, ctx->outfile, err);
+			}
+			else
+			{
+				++started;
+			}
+		}
+	}
+
+	/* Writer stage */
+	wb_init(&wb, ctx->outfile_des);
+	for (i = 0; started == 2; i++)
+	{
+		if (pipe_wait(&pl, &pl.crypt_count, i, 1) < 0)
+		{
+			break;
+		}
+		slot = &pl.slots[i % PIPE_SLOTS];
+		len = slot->len;
+		if (len == 0)
+		{
+			break;
+		}
+		if (splice && (ret = pipe_splice(ctx->outfile_des, slot->buf, len, ctx->block_size)) != 0)
+		{
+			if (ret < 0)
+			{
+				pipe_fail(&pl, ctx->outfile, errno);
+				break;
+			}
+			splice = 0;
+		}
+		if (!splice && write_full(ctx->outfile_des, slot->buf, len) < 0)
+		{
+			pipe_fail(&pl, ctx->outfile, errno);
+			break;
+		}
+		pipe_publish(&pl, &pl.write_count, i + 1);
+		/* May wait for the disk, but the slot is the reader's again already */
+		wb_advance(&wb, len);
+	}
+
+	if (started > 0)
+	{
+		pthread_join(reader, NULL);
+	}
+	if (started > 1)
+	{
+		pthread_join(cipher, NULL);
+	}
+
+	arena_free(&pl.arena);
+
+	if ((err = atomic_load(&pl.err)) != 0)
+	{
+		fprintf(stderr, "%s: %s\n", pl.err_file, strerror(err));
+		return -1;
+	}
+	return 0;
+}
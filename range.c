@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "cipher.h"
+
+/*
+ * Decrypts only the length bytes at offset of the data in ctx->infile onto
+ * ctx->outfile, reading nothing but the blocks the range is in and what
+ * stream_seek needs, up to ctx->block_size bytes at a time
+ * infile has to be seekable, outfile may be stdout
+ * A range reaching past the end of infile stops at the end
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+int decrypt_range(const struct crypt_ctx *ctx, off_t offset, off_t length)
+{
+	struct stream st;
+	struct arena arena;
+	unsigned char *buffer;
+	ssize_t bytes_read;
+	off_t size;
+	off_t data_size;
+	size_t want;
+	size_t skip;
+
+	if (file_size(ctx->infile_des, &size) < 0)
+	{
+		perror(ctx->infile);
+		return -1;
+	}
+	size -= ctx->in_base;
+	/* Padding isn't data */
+	data_size = size;
+	if (ctx->mode == MODE_CBC && cbc_data_size(ctx, size, &data_size) < 0)
+	{
+		return -1;
+	}
+	if (offset > data_size)
+	{
+		fprintf(stderr, "Error: range starts past the end of %s\n", ctx->infile);
+		return -1;
+	}
+	if (length > data_size - offset)
+	{
+		length = data_size - offset;
+	}
+
+	if ((buffer = arena_alloc(&arena, ctx->block_size)) == NULL)
+	{
+		fprintf(stderr, "%s\n", strerror(errno));
+		return -1;
+	}
+
+	/* Start on the block boundary, CBC can't start anywhere else, and skip
+	 * the bytes in front of offset once they are decrypted */
+	skip = offset & 7;
+	offset -= skip;
+	stream_init(&st, ctx);
+	if (stream_seek(&st, ctx, offset) < 0)
+	{
+		perror(ctx->infile);
+		arena_free(&arena);
+		return -1;
+	}
+
+	while (length > 0)
+	{
+		/* Whole blocks, which the end of CBC data always is */
+		want = skip + length < (off_t) ctx->block_size ?
+			(skip + length + 7) & ~(size_t) 7 : ctx->block_size;
+		if (want > size - offset)
+		{
+			want = size - offset;
+		}
+		if ((bytes_read = pread_full(ctx->infile_des, buffer, want, ctx->in_base + offset)) < 0 ||
+			(size_t) bytes_read <= skip)
+		{
+			if (bytes_read >= 0)
+			{
+				errno = EIO;
+			}
+			perror(ctx->infile);
+			arena_free(&arena);
+			return -1;
+		}
+		stream_crypt(&st, buffer, buffer, bytes_read);
+		want = (size_t) bytes_read - skip < (size_t) length ? (size_t) bytes_read - skip : (size_t) length;
+		if (write_full(ctx->outfile_des, buffer + skip, want) < 0)
+		{
+			perror(ctx->outfile);
+			arena_free(&arena);
+			return -1;
+		}
+		offset += bytes_read;
+		length -= want;
+		skip = 0;
+	}
+
+	memset(&st, 0, sizeof(st));
+	arena_free(&arena);
+	return 0;
+}
@@ -0,0 +1,268 @@
+#include <string.h>
+#include <errno.h>
+#include "cipher.h"
+
+/*
+ * Derives the IV of chunk number chunk of a chunked file from the IV in
+ * its header: the header IV plus chunk as a 64 bit big endian number,
+ * encrypted, so no two chunks of a file share an IV. That is all CFB
+ * needs. It is not used for CTR, see chunk_start. OFB chunks start at
+ * unrelated points of the keystream, which two of them could still run
+ * into each other from, a chance of about chunks * blocks / 2^64: 2^-27
+ * for a 1 GB file in 1 MB chunks, but growing with the square of the size
+ * and the number of chunks, which is why -S doesn't do OFB.
+ */
+void chunk_iv(BF_KEY *key, const unsigned char *base_iv, off_t chunk, unsigned char *iv)
+{
+	BF_LONG ti[2];
+	uint64_t v = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+	{
+		v = (v << 8) | base_iv[i];
+	}
+	v += (uint64_t) chunk;
+	ti[0] = (BF_LONG) (v >> 32);
+	ti[1] = (BF_LONG) v;
+	BF_encrypt(ti, key, BF_ENCRYPT);
+	for (i = 0; i < 4; i++)
+	{
+		iv[i] = (unsigned char) (ti[0] >> (24 - 8 * i));
+		iv[4 + i] = (unsigned char) (ti[1] >> (24 - 8 * i));
+	}
+	ti[0] = ti[1] = 0;
+}
+
+/*
+ * Sets st->iv up for the start of chunk number chunk. The chunks of a CTR
+ * file carry on the counter of the header IV, chunk n taking the counters
+ * of its own blocks in the data, n << (chunk_shift - 3) on, so no two of
+ * them share a counter however many there are; the data comes out the
+ * same as without chunks. The other modes start over with chunk_iv.
+ */
+static void chunk_start(struct stream *st, off_t chunk)
+{
+	uint64_t ctr = 0;
+	int i;
+
+	if (st->mode != MODE_CTR64)
+	{
+		chunk_iv(st->key, st->base_iv, chunk, st->iv);
+		return;
+	}
+	for (i = 0; i < 8; i++)
+	{
+		ctr = (ctr << 8) | st->base_iv[i];
+	}
+	ctr += (uint64_t) chunk << (st->chunk_shift - 3);
+	for (i = 7; i >= 0; i--, ctr >>= 8)
+	{
+		st->iv[i] = (unsigned char) ctr;
+	}
+}
+
+/*
+ * Sets st up for the start of the data described by ctx
+ */
+void stream_init(struct stream *st, const struct crypt_ctx *ctx)
+{
+	memset(st, 0, sizeof(*st));
+	st->mode = ctx->mode;
+	st->enc = ctx->enc;
+	st->key = ctx->key;
+	st->chunk_shift = ctx->chunk_shift;
+	memcpy(st->base_iv, ctx->iv, 8);
+	if (st->chunk_shift != 0)
+	{
+		chunk_start(st, 0);
+	}
+	else
+	{
+		memcpy(st->iv, ctx->iv, 8);
+	}
+}
+
+/*
+ * Moves a stream fresh from stream_init to byte offset of the data
+ * CTR only has to advance the counter. OFB has to run the keystream up to
+ * offset, which costs as much as encrypting that much. CFB needs the
+ * ciphertext block in front of offset and the bytes of the current block
+ * before it, which are read from ctx->infile, so for CFB this only works
+ * when decrypting. The same goes for CBC, which also needs offset to be on
+ * a block boundary.
+ * In a chunked file all of this is relative to the start of the chunk
+ * offset is in, so every mode can encrypt from the start of any chunk.
+ * Returns 0 on success or -1 with errno set
+ */
+int stream_seek(struct stream *st, const struct crypt_ctx *ctx, off_t offset)
+{
+	unsigned char prefix[16];
+	unsigned char scratch[8];
+	BF_LONG ti[2];
+	off_t n;
+	off_t start = 0;
+	off_t block;
+	size_t partial;
+	size_t want;
+	ssize_t got;
+	uint64_t ctr;
+	int i;
+
+	st->pos = offset;
+	if (st->chunk_shift != 0)
+	{
+		start = offset >> st->chunk_shift << st->chunk_shift;
+		chunk_start(st, offset >> st->chunk_shift);
+		offset -= start;
+	}
+	block = offset & ~(off_t) 7;
+	partial = offset - block;
+
+	if (st->mode == MODE_CTR64)
+	{
+		ctr = 0;
+		for (i = 0; i < 8; i++)
+		{
+			ctr = (ctr << 8) | st->iv[i];
+		}
+		ctr += (uint64_t) (block / 8);
+		for (i = 7; i >= 0; i--, ctr >>= 8)
+		{
+			st->iv[i] = (unsigned char) ctr;
+		}
+		/* Run the bytes of the block in front of offset to get num and ecount right */
+		memset(scratch, 0, sizeof(scratch));
+		BF_ctr64_encrypt(scratch, scratch, partial, st->key, st->iv, st->ecount, &st->num);
+		return 0;
+	}
+
+	if (st->mode == MODE_OFB64)
+	{
+		/* iv holds the last keystream block, so it is just encrypted block / 8 times */
+		ti[0] = ((BF_LONG) st->iv[0] << 24) | (st->iv[1] << 16) | (st->iv[2] << 8) | st->iv[3];
+		ti[1] = ((BF_LONG) st->iv[4] << 24) | (st->iv[5] << 16) | (st->iv[6] << 8) | st->iv[7];
+		for (n = block / 8; n > 0; n--)
+		{
+			BF_encrypt(ti, st->key, BF_ENCRYPT);
+		}
+		for (i = 0; i < 4; i++)
+		{
+			st->iv[i] = (unsigned char) (ti[0] >> (24 - 8 * i));
+			st->iv[4 + i] = (unsigned char) (ti[1] >> (24 - 8 * i));
+		}
+		memset(scratch, 0, sizeof(scratch));
+		BF_ofb64_encrypt(scratch, scratch, partial, st->key, st->iv, &st->num);
+		memset(scratch, 0, sizeof(scratch));
+		ti[0] = ti[1] = 0;
+		return 0;
+	}
+
+	if (st->enc && offset != 0)
+	{
+		errno = ESPIPE;
+		return -1;
+	}
+	if (st->mode == MODE_CBC && partial != 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* The first block of CFB or CBC uses the IV itself */
+	if (block == 0)
+	{
+		memcpy(prefix, st->iv, 8);
+		want = partial;
+		got = pread_full(ctx->infile_des, prefix + 8, want, ctx->in_base + start);
+	}
+	else
+	{
+		want = 8 + partial;
+		got = pread_full(ctx->infile_des, prefix, want, ctx->in_base + start + block - 8);
+	}
+	if (got < 0)
+	{
+		return -1;
+	}
+	/* The file is shorter than offset */
+	if ((size_t) got != want)
+	{
+		errno = EIO;
+		return -1;
+	}
+
+	memcpy(st->iv, prefix, 8);
+	st->num = 0;
+	BF_cfb64_encrypt(prefix + 8, scratch, partial, st->key, st->iv, &st->num, BF_DECRYPT);
+	memset(scratch, 0, sizeof(scratch));
+	return 0;
+}
+
+/*
+ * Runs len bytes through the cipher of st, without regard to chunks
+ */
+static void stream_crypt_mode(struct stream *st, unsigned char *in, unsigned char *out, size_t len)
+{
+	if (st->mode == MODE_CTR64)
+	{
+		BF_ctr64_encrypt(in, out, len, st->key, st->iv, st->ecount, &st->num);
+	}
+	else if (st->mode == MODE_OFB64)
+	{
+		if (st->ks != NULL)
+		{
+			ks_xor(st->ks, in, out, len);
+		}
+		else
+		{
+			BF_ofb64_encrypt(in, out, len, st->key, st->iv, &st->num);
+		}
+	}
+	else if (st->mode == MODE_CBC)
+	{
+		BF_cbc_encrypt(in, out, len, st->key, st->iv, st->enc ? BF_ENCRYPT : BF_DECRYPT);
+	}
+	else
+	{
+		BF_cfb64_encrypt(in, out, len, st->key, st->iv, &st->num,
+			st->enc ? BF_ENCRYPT : BF_DECRYPT);
+	}
+}
+
+/*
+ * Encrypts or decrypts the next len bytes of the stream, in may equal out
+ * An OFB stream with a keystream attached takes its bytes from there
+ * CBC has no use for partial blocks, len has to be a multiple of 8 except
+ * for the very end of the data when decrypting
+ * In a chunked file the cipher starts over with the next IV at every chunk
+ */
+void stream_crypt(struct stream *st, unsigned char *in, unsigned char *out, size_t len)
+{
+	off_t room;
+	size_t n;
+
+	/* The keystream thread starts the chunks over itself */
+	if (st->chunk_shift == 0 || st->ks != NULL)
+	{
+		stream_crypt_mode(st, in, out, len);
+		st->pos += len;
+		return;
+	}
+
+	while (len > 0)
+	{
+		room = (((st->pos >> st->chunk_shift) + 1) << st->chunk_shift) - st->pos;
+		n = (off_t) len < room ? len : (size_t) room;
+		stream_crypt_mode(st, in, out, n);
+		in += n;
+		out += n;
+		len -= n;
+		st->pos += n;
+		if (n == (size_t) room)
+		{
+			chunk_start(st, st->pos >> st->chunk_shift);
+			st->num = 0;
+		}
+	}
+}
@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "cipher.h"
+
+/*
+ * The serial path on io_uring: up to URING_SLOTS reads and writes of
+ * ctx->block_size bytes are kept in flight from a single thread, and the
+ * data is run through the stream in order as the reads complete. Talks
+ * to the kernel with the raw system calls so there is nothing to link.
+ *
+ * Chunk j of the data always goes through slots[j % URING_SLOTS], so a
+ * chunk can only be read once the chunk URING_SLOTS before it is written.
+ */
+
+#define URING_SLOTS 8
+
+enum { SLOT_FREE, SLOT_READING, SLOT_READ, SLOT_WRITING };
+
+struct uring_slot
+{
+	unsigned char *buf;
+	int state;
+	off_t offset;		/* of the chunk in the data */
+	size_t len;
+	size_t done;		/* bytes of the current read or write completed */
+};
+
+struct uring
+{
+	int fd;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr;
+	size_t sq_len;
+	void *cq_ptr;
+	size_t cq_len;
+	size_t sqes_len;
+	unsigned int to_submit;
+	int fixed_files;	/* infile and outfile are registered as 0 and 1 */
+	int fixed_bufs;		/* the slot buffers are registered */
+};
+
+/*
+ * Sets up a ring with room for entries requests
+ * Returns 0 on success or -1 with errno set
+ */
+static int uring_init(struct uring *ring, unsigned int entries)
+{
+	struct io_uring_params params;
+	int fd;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&params, 0, sizeof(params));
+	if ((fd = syscall(__NR_io_uring_setup, entries, &params)) < 0)
+	{
+		return -1;
+	}
+	ring->fd = fd;
+
+	ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (ring->cq_len > ring->sq_len)
+		{
+			ring->sq_len = ring->cq_len;
+		}
+		ring->cq_len = ring->sq_len;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED)
+	{
+		close(fd);
+		return -1;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		ring->cq_ptr = ring->sq_ptr;
+	}
+	else if ((ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+	{
+		munmap(ring->sq_ptr, ring->sq_len);
+		close(fd);
+		return -1;
+	}
+	ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+	if ((ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES)) == MAP_FAILED)
+	{
+		if (ring->cq_ptr != ring->sq_ptr)
+		{
+			munmap(ring->cq_ptr, ring->cq_len);
+		}
+		munmap(ring->sq_ptr, ring->sq_len);
+		close(fd);
+		return -1;
+	}
+
+	ring->sq_head = (unsigned int *) ((char *) ring->sq_ptr + params.sq_off.head);
+	ring->sq_tail = (unsigned int *) ((char *) ring->sq_ptr + params.sq_off.tail);
+	ring->sq_mask = (unsigned int *) ((char *) ring->sq_ptr + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *) ((char *) ring->sq_ptr + params.sq_off.array);
+	ring->cq_head = (unsigned int *) ((char *) ring->cq_ptr + params.cq_off.head);
+	ring->cq_tail = (unsigned int *) ((char *) ring->cq_ptr + params.cq_off.tail);
+	ring->cq_mask = (unsigned int *) ((char *) ring->cq_ptr + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ptr + params.cq_off.cqes);
+	return 0;
+}
+
+/*
+ * Unmaps and closes the ring, which also drops anything registered
+ */
+static void uring_exit(struct uring *ring)
+{
+	munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_ptr != ring->sq_ptr)
+	{
+		munmap(ring->cq_ptr, ring->cq_len);
+	}
+	munmap(ring->sq_ptr, ring->sq_len);
+	close(ring->fd);
+}
+
+/*
+ * Queues a read or write of len bytes between buf and offset of the file
+ * user_data comes back with the completion
+ */
+static void uring_queue(struct uring *ring, int write, int file_des, int file_index,
+	unsigned char *buf, size_t len, off_t offset, int buf_index, unsigned long user_data)
+{
+	unsigned int tail = *ring->sq_tail;
+	unsigned int index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	if (ring->fixed_bufs)
+	{
+		sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->buf_index = buf_index;
+	}
+	else
+	{
+		sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	}
+	if (ring->fixed_files)
+	{
+		sqe->fd = file_index;
+		sqe->flags = IOSQE_FIXED_FILE;
+	}
+	else
+	{
+		sqe->fd = file_des;
+	}
+	sqe->addr = (unsigned long) buf;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = user_data;
+	ring->sq_array[index] = index;
+
+	/* The kernel must see the entry before the new tail */
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->to_submit++;
+}
+
+/*
+ * Submits what is queued and waits for at least one completion
+ * Returns 0 on success or -1 with errno set
+ */
+static int uring_submit_wait(struct uring *ring)
+{
+	int ret;
+
+	while ((ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1,
+		IORING_ENTER_GETEVENTS, NULL, 0)) < 0)
+	{
+		if (errno != EINTR)
+		{
+			return -1;
+		}
+	}
+	ring->to_submit -= ret;
+	return 0;
+}
+
+/*
+ * Queues the rest of the current read or write of a slot
+ */
+static void uring_queue_slot(struct uring *ring, const struct crypt_ctx *ctx, struct uring_slot *slots,
+	int i, off_t in_start, off_t out_start)
+{
+	struct uring_slot *slot = &slots[i];
+
+	if (slot->state == SLOT_READING)
+	{
+		uring_queue(ring, 0, ctx->infile_des, 0, slot->buf + slot->done, slot->len - slot->done,
+			in_start + slot->offset + slot->done, i, i);
+	}
+	else
+	{
+		uring_queue(ring, 1, ctx->outfile_des, 1, slot->buf + slot->done, slot->len - slot->done,
+			out_start + slot->offset + slot->done, i, i);
+	}
+}
+
+/*
+ * Moves the data along: queues reads into free slots, runs finished reads
+ * through the stream in order and queues their writes, then waits for
+ * completions and requeues whatever came back short
+ * Returns 0 on success, otherwise prints the error and returns -1
+ */
+static int uring_loop(struct uring *ring, const struct crypt_ctx *ctx, struct stream *st,
+	struct uring_slot *slots, off_t size, off_t in_start, off_t out_start)
+{
+	struct writebehind wb;
+	off_t block = ctx->block_size;
+	off_t chunks = (size + block - 1) / block;
+	off_t next_read = 0;
+	off_t next_crypt = 0;
+	off_t written = 0;
+	struct uring_slot *slot;
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+	int i;
+
+	/* Writes complete out of order, but never far out of it */
+	wb_init(&wb, ctx->outfile_des);
+	while (written < chunks)
+	{
+		while (next_read < chunks && slots[next_read % URING_SLOTS].state == SLOT_FREE)
+		{
+			i = next_read % URING_SLOTS;
+			slot = &slots[i];
+			slot->state = SLOT_READING;
+			slot->offset = next_read * block;
+			slot->len = size - slot->offset < block ? size - slot->offset : block;
+			slot->done = 0;
+			uring_queue_slot(ring, ctx, slots, i, in_start, out_start);
+			next_read++;
+		}
+
+		while (next_crypt < chunks && slots[next_crypt % URING_SLOTS].state == SLOT_READ)
+		{
+			i = next_crypt % URING_SLOTS;
+			slot = &slots[i];
+			stream_crypt(st, slot->buf, slot->buf, slot->len);
+			slot->state = SLOT_WRITING;
+			slot->done = 0;
+			uring_queue_slot(ring, ctx, slots, i, in_start, out_start);
+			next_crypt++;
+		}
+
+		if (uring_submit_wait(ring) < 0)
+		{
+			perror("io_uring");
+			return -1;
+		}
+
+		head = *ring->cq_head;
+		while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		{
+			cqe = &ring->cqes[head & *ring->cq_mask];
+			slot = &slots[cqe->user_data];
+			if (cqe->res < 0 || (cqe->res == 0 && slot->state == SLOT_READING))
+			{
+				/* A read of nothing means the file shrank under us */
+				errno = cqe->res < 0 ? -cqe->res : EIO;
+				perror(slot->state == SLOT_READING ? ctx->infile : ctx->outfile);
+				return -1;
+			}
+			slot->done += cqe->res;
+			if (slot->done < slot->len)
+			{
+				uring_queue_slot(ring, ctx, slots, cqe->user_data, in_start, out_start);
+			}
+			else if (slot->state == SLOT_READING)
+			{
+				slot->state = SLOT_READ;
+			}
+			else
+			{
+				slot->state = SLOT_FREE;
+				written++;
+				wb_advance(&wb, slot->len);
+			}
+			head++;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+/*
+ * Runs the rest of ctx->infile through st onto ctx->outfile with io_uring
+ * Both have to be regular files; the data starts at their current offsets
+ * Returns 0 on success, 1 if io_uring can't be used here, in which case
+ * nothing has been read or written, otherwise prints the error and
+ * returns -1
+ */
+int crypt_uring(const struct crypt_ctx *ctx, struct stream *st)
+{
+	struct uring ring;
+	struct arena arena;
+	struct uring_slot slots[URING_SLOTS];
+	struct iovec iov[URING_SLOTS];
+	struct stat infile_stat;
+	struct stat outfile_stat;
+	off_t in_start;
+	off_t out_start;
+	off_t size;
+	int files[2];
+	int ret;
+	int i;
+
+	if (fstat(ctx->infile_des, &infile_stat) < 0 || fstat(ctx->outfile_des, &outfile_stat) < 0 ||
+		!(S_ISREG(infile_stat.st_mode) || S_ISBLK(infile_stat.st_mode)) ||
+		!(S_ISREG(outfile_stat.st_mode) || S_ISBLK(outfile_stat.st_mode)) ||
+		file_size(ctx->infile_des, &size) < 0 ||
+		(in_start = lseek(ctx->infile_des, 0, SEEK_CUR)) < 0 ||
+		(out_start = lseek(ctx->outfile_des, 0, SEEK_CUR)) < 0)
+	{
+		return 1;
+	}
+
+	/* Not built into the kernel, or disabled */
+	if (uring_init(&ring, URING_SLOTS) < 0)
+	{
+		return 1;
+	}
+
+	if (arena_alloc(&arena, URING_SLOTS * ctx->block_size) == NULL)
+	{
+		uring_exit(&ring);
+		return 1;
+	}
+	memset(slots, 0, sizeof(slots));
+	for (i = 0; i < URING_SLOTS; i++)
+	{
+		slots[i].buf = arena.base + i * ctx->block_size;
+		iov[i].iov_base = slots[i].buf;
+		iov[i].iov_len = ctx->block_size;
+	}
+
+	/* Both save the kernel work per request, neither is needed */
+	files[0] = ctx->infile_des;
+	files[1] = ctx->outfile_des;
+	ring.fixed_files = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES, files, 2) == 0;
+	ring.fixed_bufs = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iov,
+		URING_SLOTS) == 0;
+
+	ret = uring_loop(&ring, ctx, st, slots, size > in_start ? size - in_start : 0, in_start, out_start);
+
+	uring_exit(&ring);
+	arena_free(&arena);
+	return ret;
+}